@@ -0,0 +1,590 @@
+// Copyright 2021 Josh Bailey (josh@vandervecken.com)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// asidbridge: ALSA sequencer client between an ASID player and the MIDI port
+// feeding VAP. Register writes from the player are merged into per-SID
+// pending state, and once per frame only the registers that differ from what
+// VAP already has are sent, as whichever of 0x4e/0x50 or 0x6c/0x6d is
+// shorter. VAP-FULL acks each SysEx with MIDI_CLOCK, and those acks pace the
+// output: while too many frames are unacked, writes keep merging instead of
+// queueing up behind the link.
+
+#include "regid.h"
+#include <alsa/asoundlib.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIDS 2
+#define SIDREGS 25
+#define SIDCTRL 4
+#define GATE 0x01
+#define IDS sizeof(regidmap)
+#define MAXMSG 64
+#define ACK_TIMEOUT_MS 250
+
+#define MIDI_CLOCK 0xf8
+#define SYSEX_START 0xf0
+#define SYSEX_STOP 0xf7
+#define ASID_MANID 0x2d
+#define NOTEOFF_CHANNEL16 15
+#define NOTEOFF_CHANNEL15 14
+
+enum ASID_CMD {
+  ASID_CMD_START = 0x4c,
+  ASID_CMD_STOP = 0x4d,
+  ASID_CMD_UPDATE = 0x4e,
+  ASID_CMD_UPDATE2 = 0x50,
+  ASID_CMD_UPDATE_BOTH = 0x51,
+  ASID_CMD_UPDATE_REG = 0x6c,
+  ASID_CMD_UPDATE2_REG = 0x6d,
+};
+
+struct sidstate {
+  unsigned char pending[SIDREGS];
+  unsigned char sent[SIDREGS];
+  uint32_t dirty; // pending differs from (or was never) sent
+  uint32_t known; // sent is what VAP has
+};
+
+static struct {
+  unsigned long msgsin;
+  unsigned long writesin;
+  unsigned long writesout;
+  unsigned long update;
+  unsigned long updatereg;
+  unsigned long passthrough;
+  unsigned long acks;
+  unsigned long skipped;
+} stats;
+
+static snd_seq_t *seq;
+static int playerport;
+static int vapport;
+static struct sidstate sids[SIDS];
+static unsigned char regid[SIDREGS];
+static unsigned char sysex[MAXMSG];
+static size_t sysexlen;
+static int passthrough;
+static unsigned int window = 2;
+static unsigned int outstanding;
+static unsigned int rate = 50;
+static int useacks = 1;
+static int verbose;
+static uint64_t lastack;
+static double ackinterval;
+static volatile sig_atomic_t running = 1;
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stop(int sig) {
+  (void)sig;
+  running = 0;
+}
+
+static void send_sysex(const unsigned char *data, size_t len) {
+  snd_seq_event_t ev;
+  snd_seq_ev_clear(&ev);
+  snd_seq_ev_set_source(&ev, vapport);
+  snd_seq_ev_set_subs(&ev);
+  snd_seq_ev_set_direct(&ev);
+  snd_seq_ev_set_sysex(&ev, len, (void *)data);
+  if (snd_seq_event_output_direct(seq, &ev) < 0) {
+    fprintf(stderr, "asidbridge: dropped %zu byte SysEx\n", len);
+  }
+}
+
+// Acked messages hold a slot in the window until VAP's MIDI_CLOCK arrives.
+static void send_acked(const unsigned char *data, size_t len) {
+  send_sysex(data, len);
+  if (useacks) {
+    if (!outstanding) {
+      lastack = now_ms();
+    }
+    ++outstanding;
+  }
+}
+
+static int can_send(void) { return !useacks || outstanding < window; }
+
+// 0x4e/0x50: mask, MSB and LSB bytes for every register ID.
+static size_t encode_update(struct sidstate *s, unsigned char cmd,
+                            unsigned char *msg) {
+  unsigned char *mask = msg + 3;
+  unsigned char *msb = msg + 7;
+  size_t len = 11;
+  msg[0] = SYSEX_START;
+  msg[1] = ASID_MANID;
+  msg[2] = cmd;
+  memset(mask, 0, 8);
+  for (unsigned char id = 0; id < IDS; ++id) {
+    unsigned char reg = regidmap[id];
+    if (regid[reg] != id || !(s->dirty & (1UL << reg))) {
+      continue;
+    }
+    unsigned char val = s->pending[reg];
+    mask[id / 7] |= 1 << (id % 7);
+    if (val & 0x80) {
+      msb[id / 7] |= 1 << (id % 7);
+    }
+    msg[len++] = val & 0x7f;
+  }
+  msg[len++] = SYSEX_STOP;
+  return len;
+}
+
+// 0x6c/0x6d: register/value pairs, register bit 6 carrying the value's MSB.
+static size_t encode_update_reg(struct sidstate *s, unsigned char cmd,
+                                unsigned char *msg) {
+  size_t len = 3;
+  msg[0] = SYSEX_START;
+  msg[1] = ASID_MANID;
+  msg[2] = cmd;
+  for (unsigned char reg = 0; reg < SIDREGS; ++reg) {
+    if (!(s->dirty & (1UL << reg))) {
+      continue;
+    }
+    unsigned char val = s->pending[reg];
+    msg[len++] = reg | ((val & 0x80) >> 1);
+    msg[len++] = val & 0x7f;
+  }
+  msg[len++] = SYSEX_STOP;
+  return len;
+}
+
+static void flush_sid(unsigned char sid) {
+  static const unsigned char update[SIDS] = {ASID_CMD_UPDATE, ASID_CMD_UPDATE2};
+  static const unsigned char updatereg[SIDS] = {ASID_CMD_UPDATE_REG,
+                                                ASID_CMD_UPDATE2_REG};
+  struct sidstate *s = &sids[sid];
+  unsigned char msg[MAXMSG];
+  unsigned int n = __builtin_popcount(s->dirty);
+  size_t len;
+  if (!n) {
+    return;
+  }
+  if (4 + 2 * n < 12 + n) {
+    len = encode_update_reg(s, updatereg[sid], msg);
+    ++stats.updatereg;
+  } else {
+    len = encode_update(s, update[sid], msg);
+    ++stats.update;
+  }
+  send_acked(msg, len);
+  memcpy(s->sent, s->pending, sizeof(s->sent));
+  s->known |= s->dirty;
+  s->dirty = 0;
+  stats.writesout += n;
+}
+
+static void flush(void) {
+  for (unsigned char sid = 0; sid < SIDS; ++sid) {
+    flush_sid(sid);
+  }
+}
+
+static int pending(void) {
+  for (unsigned char sid = 0; sid < SIDS; ++sid) {
+    if (sids[sid].dirty) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void write_reg(unsigned char sid, unsigned char reg,
+                      unsigned char val) {
+  struct sidstate *s = &sids[sid];
+  if (reg >= SIDREGS) {
+    return;
+  }
+  uint32_t bit = 1UL << reg;
+  ++stats.writesin;
+  // VAP applies a whole frame to its shadow registers before writing the
+  // SID, so a gate off then on within one frame would never reach the chip.
+  // Send the gate off in a frame of its own first, even if the window is
+  // full: dropping a retrigger is worse than briefly exceeding it.
+  if (reg % 7 == SIDCTRL && (s->dirty & bit) && !(s->pending[reg] & GATE) &&
+      (val & GATE)) {
+    flush_sid(sid);
+  }
+  s->pending[reg] = val;
+  if ((s->known & bit) && s->sent[reg] == val) {
+    s->dirty &= ~bit;
+  } else {
+    s->dirty |= bit;
+  }
+}
+
+static void reset_sids(void) {
+  // VAP's start and stop commands both zero every SID register.
+  memset(sids, 0, sizeof(sids));
+  for (unsigned char sid = 0; sid < SIDS; ++sid) {
+    sids[sid].known = (1UL << SIDREGS) - 1;
+  }
+}
+
+static void decode_update(unsigned char sid, const unsigned char *msg,
+                          size_t len) {
+  const unsigned char *mask = msg + 3;
+  const unsigned char *msb = msg + 7;
+  const unsigned char *lsb = msg + 11;
+  const unsigned char *end = msg + len - 1;
+  for (unsigned char id = 0; id < IDS && lsb < end; ++id) {
+    unsigned char bit = 1 << (id % 7);
+    if (!(mask[id / 7] & bit)) {
+      continue;
+    }
+    unsigned char val = *lsb++;
+    if (msb[id / 7] & bit) {
+      val |= 0x80;
+    }
+    write_reg(sid, regidmap[id], val);
+  }
+}
+
+static void decode_update_reg(unsigned char sid, const unsigned char *msg,
+                              size_t len) {
+  for (size_t i = 3; i + 2 < len; i += 2) {
+    unsigned char reg = msg[i];
+    unsigned char val = msg[i + 1];
+    if (reg & 0x40) {
+      reg &= 0x3f;
+      val |= 0x80;
+    }
+    write_reg(sid, reg, val);
+  }
+}
+
+static void handle_asid(const unsigned char *msg, size_t len) {
+  ++stats.msgsin;
+  switch (msg[2]) {
+  case ASID_CMD_UPDATE:
+    if (len >= 12) {
+      decode_update(0, msg, len);
+    }
+    break;
+  case ASID_CMD_UPDATE2:
+    if (len >= 12) {
+      decode_update(1, msg, len);
+    }
+    break;
+  case ASID_CMD_UPDATE_BOTH:
+    if (len >= 12) {
+      decode_update(0, msg, len);
+      decode_update(1, msg, len);
+    }
+    break;
+  case ASID_CMD_UPDATE_REG:
+    decode_update_reg(0, msg, len);
+    break;
+  case ASID_CMD_UPDATE2_REG:
+    decode_update_reg(1, msg, len);
+    break;
+  default:
+    flush();
+    send_acked(msg, len);
+    ++stats.passthrough;
+    if (msg[2] == ASID_CMD_START || msg[2] == ASID_CMD_STOP) {
+      reset_sids();
+    }
+    break;
+  }
+}
+
+// Reassemble SysEx from the player. ALSA may split long messages; anything
+// that is not a register update is forwarded piecewise as it arrives.
+static void handle_sysex(const unsigned char *data, size_t len) {
+  if (len && data[0] == SYSEX_START) {
+    sysexlen = 0;
+    passthrough = 0;
+  }
+  if (passthrough) {
+    send_sysex(data, len);
+    return;
+  }
+  if (sysexlen + len > sizeof(sysex)) {
+    // Too long for a register update: forward what we have and the rest.
+    const unsigned char *head = sysexlen ? sysex : data;
+    size_t headlen = sysexlen ? sysexlen : len;
+    flush();
+    if (headlen >= 2 && head[1] == ASID_MANID) {
+      send_acked(head, headlen);
+    } else {
+      send_sysex(head, headlen);
+    }
+    if (sysexlen) {
+      send_sysex(data, len);
+    }
+    ++stats.passthrough;
+    passthrough = 1;
+    return;
+  }
+  memcpy(sysex + sysexlen, data, len);
+  sysexlen += len;
+  if (sysex[sysexlen - 1] != SYSEX_STOP) {
+    return;
+  }
+  if (sysexlen >= 4 && sysex[0] == SYSEX_START && sysex[1] == ASID_MANID) {
+    handle_asid(sysex, sysexlen);
+  } else {
+    send_sysex(sysex, sysexlen);
+    ++stats.passthrough;
+  }
+  sysexlen = 0;
+}
+
+static void handle_ack(void) {
+  uint64_t t = now_ms();
+  if (lastack) {
+    ackinterval = ackinterval ? (ackinterval * 7 + (t - lastack)) / 8
+                              : (double)(t - lastack);
+  }
+  lastack = t;
+  ++stats.acks;
+  if (outstanding) {
+    --outstanding;
+  }
+}
+
+// Other channel messages (such as CCs for VAP-FULL's direct control) go to
+// VAP unchanged, as they arrive. A CC may write any SID register, so after one
+// nothing VAP holds is known.
+static void forward_event(snd_seq_event_t *ev) {
+  switch (ev->type) {
+  case SND_SEQ_EVENT_CONTROLLER:
+  case SND_SEQ_EVENT_CONTROL14:
+  case SND_SEQ_EVENT_NONREGPARAM:
+  case SND_SEQ_EVENT_REGPARAM:
+    for (unsigned char sid = 0; sid < SIDS; ++sid) {
+      sids[sid].known = 0;
+    }
+    break;
+  default:
+    break;
+  }
+  snd_seq_ev_set_source(ev, vapport);
+  snd_seq_ev_set_subs(ev);
+  snd_seq_ev_set_direct(ev);
+  if (snd_seq_event_output_direct(seq, ev) < 0) {
+    fprintf(stderr, "asidbridge: dropped event type %d\n", ev->type);
+  }
+  ++stats.passthrough;
+}
+
+static void handle_event(snd_seq_event_t *ev) {
+  if (ev->dest.port == vapport) {
+    if (ev->type == SND_SEQ_EVENT_CLOCK) {
+      handle_ack();
+    }
+    return;
+  }
+  switch (ev->type) {
+  case SND_SEQ_EVENT_SYSEX:
+    handle_sysex(ev->data.ext.ptr, ev->data.ext.len);
+    break;
+  case SND_SEQ_EVENT_NOTEOFF:
+    // VAP-FULL's single register form: note off on channel 16 (SID 1) or
+    // 15 (SID 2), note is the register, velocity the value.
+    if (ev->data.note.channel == NOTEOFF_CHANNEL16 ||
+        ev->data.note.channel == NOTEOFF_CHANNEL15) {
+      unsigned char reg = ev->data.note.note;
+      unsigned char val = ev->data.note.velocity;
+      if (reg & 0x40) {
+        reg &= 0x3f;
+        val |= 0x80;
+      }
+      write_reg(ev->data.note.channel == NOTEOFF_CHANNEL15, reg, val);
+    } else {
+      forward_event(ev);
+    }
+    break;
+  default:
+    if (snd_seq_ev_is_channel_type(ev)) {
+      forward_event(ev);
+    }
+    break;
+  }
+}
+
+static void connect_port(int port, const char *name, int in, int out) {
+  snd_seq_addr_t addr;
+  if (snd_seq_parse_address(seq, &addr, name) < 0) {
+    fprintf(stderr, "asidbridge: invalid port %s\n", name);
+    exit(1);
+  }
+  if ((in && snd_seq_connect_from(seq, port, addr.client, addr.port) < 0) ||
+      (out && snd_seq_connect_to(seq, port, addr.client, addr.port) < 0)) {
+    fprintf(stderr, "asidbridge: cannot connect to %s\n", name);
+    exit(1);
+  }
+}
+
+static void print_stats(void) {
+  fprintf(stderr,
+          "in %lu msgs %lu writes, out %lu writes in %lu 0x4e/0x50 + %lu "
+          "0x6c/0x6d, %lu passthrough, %lu acks (%.1f/s), %lu frames "
+          "deferred, %u unacked\n",
+          stats.msgsin, stats.writesin, stats.writesout, stats.update,
+          stats.updatereg, stats.passthrough, stats.acks,
+          ackinterval ? 1000 / ackinterval : 0, stats.skipped, outstanding);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-i player-port] [-o vap-port] [-r frames/s] "
+          "[-w window] [-n] [-v]\n"
+          "  -i  connect the player's ALSA port to our input\n"
+          "  -o  connect our output to (and acks from) VAP's MIDI port\n"
+          "  -r  frame rate to merge and send updates at (default 50)\n"
+          "  -w  unacked SysEx allowed in flight (default 2)\n"
+          "  -n  VAP does not ack (non-FULL builds): pace by -r only\n"
+          "  -v  print statistics every second\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *player = NULL;
+  const char *vap = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:r:w:nvh")) != -1) {
+    switch (opt) {
+    case 'i':
+      player = optarg;
+      break;
+    case 'o':
+      vap = optarg;
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'n':
+      useacks = 0;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (!rate || !window) {
+    usage(argv[0]);
+  }
+
+  if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) <
+      0) {
+    fprintf(stderr, "asidbridge: cannot open ALSA sequencer\n");
+    return 1;
+  }
+  snd_seq_set_client_name(seq, "asidbridge");
+  playerport = snd_seq_create_simple_port(
+      seq, "player", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+      SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+  vapport = snd_seq_create_simple_port(
+      seq, "vap",
+      SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ |
+          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+      SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+  if (playerport < 0 || vapport < 0) {
+    fprintf(stderr, "asidbridge: cannot create ports\n");
+    return 1;
+  }
+  if (player) {
+    connect_port(playerport, player, 1, 0);
+  }
+  if (vap) {
+    connect_port(vapport, vap, 1, 1);
+  }
+
+  for (unsigned char id = IDS; id--;) {
+    regid[regidmap[id]] = id;
+  }
+  // VAP may already hold state, so nothing is known until a start or stop
+  // passes through.
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  int npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
+  struct pollfd *pfd = calloc(npfd, sizeof(*pfd));
+  snd_seq_poll_descriptors(seq, pfd, npfd, POLLIN);
+  uint64_t frame = 1000 / rate;
+  uint64_t nextframe = now_ms() + frame;
+  uint64_t nextstats = now_ms() + 1000;
+  int deferred = 0;
+
+  while (running) {
+    uint64_t t = now_ms();
+    int timeout = nextframe > t ? (int)(nextframe - t) : 0;
+    if (poll(pfd, npfd, timeout) > 0) {
+      snd_seq_event_t *ev;
+      int unacked = outstanding;
+      while (snd_seq_event_input(seq, &ev) >= 0) {
+        handle_event(ev);
+      }
+      // A frame held back for want of acks goes as soon as one arrives.
+      if (deferred && outstanding < (unsigned int)unacked && can_send()) {
+        flush();
+        deferred = 0;
+      }
+    }
+    t = now_ms();
+    if (outstanding && t - lastack > ACK_TIMEOUT_MS) {
+      // Lost acks (or a command VAP does not ack) must not stall us.
+      outstanding = 0;
+    }
+    if (t >= nextframe) {
+      nextframe += frame;
+      if (nextframe < t) {
+        nextframe = t + frame;
+      }
+      if (can_send()) {
+        flush();
+        deferred = 0;
+      } else if (pending()) {
+        ++stats.skipped;
+        deferred = 1;
+      }
+    }
+    if (verbose && t >= nextstats) {
+      nextstats += 1000;
+      print_stats();
+    }
+  }
+  flush();
+  if (verbose) {
+    print_stats();
+  }
+  snd_seq_close(seq);
+  return 0;
+}
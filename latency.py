@@ -0,0 +1,414 @@
+#!/usr/bin/env python3
+
+# End to end latency harness (see README). Runs SCRIPT builds of VAP under
+# headless VICE, feeding each a script of ASID messages in place of Vessel
+# input, and measures the cycles from the read of each message's last byte to
+# its write of SID register 0. Each message is matched to the next write of
+# $D400 in order, since every test message writes it exactly once.
+
+import argparse
+import json
+import os
+import re
+import shlex
+import statistics
+import struct
+import subprocess
+import sys
+
+SCRIPT_BASE = 0x9000
+# Keep clear of the soft stack, which grows down from $D000.
+SCRIPT_END = 0xC000
+SIDBASE = 0xD400
+SIDEND = 0xD43F
+
+SYSEX_START = 0xF0
+ASID_MANID = 0x2D
+SYSEX_STOP = 0xF7
+NOTEOFF16 = 0x8F
+ASID_CMD_UPDATE = 0x4E
+ASID_CMD_UPDATE_REG = 0x6C
+
+MESSAGES = 64
+BURST = 8
+IDLE_READS = 16
+LIMIT_CYCLES = 20000000
+
+TRACE_RE = re.compile(r"\(Trace\s+(load|store)\s+([0-9a-fA-F]{4})\)")
+CLOCK_RE = re.compile(r"^\.C:[0-9a-fA-F]{4}\s.*\s(\d+)\s*$")
+
+
+def read_regidmap(path):
+    with open(path) as f:
+        ids = re.findall(r"(\d+),\s*// ID (\d+)", f.read())
+    return [int(reg) for reg, _ in sorted(ids, key=lambda x: int(x[1]))]
+
+
+def msg_update(regidmap, seq):
+    # Register 0 carries the sequence number, plus a typical voice 1 update.
+    vals = {0: seq & 0x7F, 1: 0x10, 4: 0x41, 5: 0x09, 6: 0xF0, 24: 0x0F}
+    mask = [0] * 4
+    msb = [0] * 4
+    lsb = []
+    for i, reg in enumerate(regidmap):
+        if reg not in vals or regidmap.index(reg) != i:
+            continue
+        mask[i // 7] |= 1 << (i % 7)
+        if vals[reg] & 0x80:
+            msb[i // 7] |= 1 << (i % 7)
+        lsb.append(vals[reg] & 0x7F)
+    return (
+        [SYSEX_START, ASID_MANID, ASID_CMD_UPDATE] + mask + msb + lsb + [SYSEX_STOP]
+    )
+
+
+def msg_update_reg(_regidmap, seq):
+    return [
+        SYSEX_START,
+        ASID_MANID,
+        ASID_CMD_UPDATE_REG,
+        0,
+        seq & 0x7F,
+        1,
+        0x10,
+        SYSEX_STOP,
+    ]
+
+
+def msg_noteoff(_regidmap, seq):
+    return [NOTEOFF16, 0, seq & 0x7F]
+
+
+# Command type: (message encoder, FULL only).
+COMMANDS = {
+    "4e": (msg_update, False),
+    "6c": (msg_update_reg, False),
+    "noteoff": (msg_noteoff, True),
+}
+
+
+def build_script(messages, burst, full):
+    """Return the PORTB reads that deliver messages, and the script offset of
+    each message's last byte.
+
+    NMI and POLL builds read the same way. VAP-FULL reads a count then that
+    many bytes. The other builds read a count and then bytes up to the end of
+    one SysEx, then read the count of what is still waiting before the next.
+    Between batches of burst messages, VAP reads IDLE_READS counts of 0 (no
+    input waiting)."""
+    script = []
+    last = []
+    for i in range(0, len(messages), burst):
+        batch = messages[i : i + burst]
+        remaining = sum(len(m) for m in batch)
+        if remaining > 255:
+            raise ValueError("batch of %u bytes is too large" % remaining)
+        if full:
+            script.append(remaining)
+        for m in batch:
+            if not full:
+                script.append(remaining)
+            script.extend(m)
+            last.append(len(script) - 1)
+            remaining -= len(m)
+        script.extend([0] * IDLE_READS)
+    if len(script) > SCRIPT_END - SCRIPT_BASE - 2:
+        raise ValueError("script of %u bytes is too large" % len(script))
+    return script, last
+
+
+def elf_symbol(path, name):
+    """Return the value of symbol name in a little endian ELF32 file, such as
+    the .elf llvm-mos writes next to each PRG."""
+    with open(path, "rb") as f:
+        elf = f.read()
+    if elf[:6] != b"\x7fELF\x01\x01":
+        raise ValueError("%s is not a little endian ELF32 file" % path)
+    shoff = struct.unpack_from("<I", elf, 0x20)[0]
+    shentsize, shnum = struct.unpack_from("<HH", elf, 0x2E)
+    sections = [
+        struct.unpack_from("<IIIIIIIIII", elf, shoff + i * shentsize)
+        for i in range(shnum)
+    ]
+    for sh in sections:
+        # SHT_SYMTAB, linked to its string table.
+        if sh[1] != 2:
+            continue
+        strtab = sections[sh[6]][4]
+        for off in range(sh[4], sh[4] + sh[5], sh[9]):
+            st_name, st_value = struct.unpack_from("<II", elf, off)
+            end = elf.index(b"\0", strtab + st_name)
+            if elf[strtab + st_name : end].decode() == name:
+                return st_value
+    raise ValueError("%s has no symbol %s" % (path, name))
+
+
+def script_prg(prg, script, heap_start):
+    """Append script to prg at SCRIPT_BASE. heap_start is the end of .bss,
+    which crt0 zeroes, so it must not reach the script either."""
+    load = struct.unpack("<H", prg[:2])[0]
+    end = load + len(prg) - 2
+    if max(end, heap_start) > SCRIPT_BASE:
+        raise ValueError(
+            "PRG and .bss end at $%04x, past the script at $%04x"
+            % (max(end, heap_start), SCRIPT_BASE)
+        )
+    pad = bytes(SCRIPT_BASE - end)
+    return prg + pad + struct.pack("<H", len(script)) + bytes(script)
+
+
+def run_vice(x64sc, prg, workdir, script_len):
+    moncmds = os.path.join(workdir, "mon.txt")
+    monlog = os.path.join(workdir, "mon.log")
+    data = SCRIPT_BASE + 2
+    with open(moncmds, "w") as f:
+        f.write("trace store %04x %04x\n" % (SIDBASE, SIDEND))
+        f.write("trace load %04x %04x\n" % (data, data + script_len - 1))
+    if os.path.exists(monlog):
+        os.unlink(monlog)
+    cmd = shlex.split(x64sc) + [
+        "-default",
+        "-warp",
+        "-sounddev",
+        "dummy",
+        "-sidextra",
+        "1",
+        "-sid2address",
+        "0xd420",
+        "-moncommands",
+        moncmds,
+        "-monlog",
+        "-monlogname",
+        monlog,
+        "-limitcycles",
+        str(LIMIT_CYCLES),
+        "-autostartprgmode",
+        "1",
+        "-autostart",
+        prg,
+    ]
+    # -limitcycles always quits with an error status.
+    proc = subprocess.run(
+        cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True
+    )
+    text = ""
+    if os.path.exists(monlog):
+        with open(monlog) as f:
+            text = f.read()
+    if not TRACE_RE.search(text):
+        text = proc.stdout
+    return text
+
+
+def run_script(args, prgname, name, script):
+    """Run prgname with script appended, as workdir/name.prg, and return the
+    trace."""
+    with open(prgname, "rb") as f:
+        prg = f.read()
+    heap_start = elf_symbol(prgname + ".elf", "__heap_start")
+    runprg = os.path.join(args.workdir, "%s.prg" % name)
+    with open(runprg, "wb") as f:
+        f.write(script_prg(prg, script, heap_start))
+    return run_vice(args.x64sc, runprg, args.workdir, len(script))
+
+
+def parse_trace(text):
+    events = []
+    pending = None
+    for line in text.splitlines():
+        m = TRACE_RE.search(line)
+        if m:
+            pending = (m.group(1), int(m.group(2), 16))
+            continue
+        m = CLOCK_RE.match(line.strip())
+        if m and pending:
+            events.append((int(m.group(1)), pending[0], pending[1]))
+            pending = None
+    return events
+
+
+def latencies(events, last):
+    data = SCRIPT_BASE + 2
+    loads = {}
+    for clock, kind, addr in events:
+        if kind == "load" and addr not in loads:
+            loads[addr] = clock
+    if not loads:
+        raise ValueError("no script reads traced")
+    start = min(loads.values())
+    stores = [c for c, kind, addr in events if kind == "store" and c >= start]
+    reg0 = [
+        c
+        for c, kind, addr in events
+        if kind == "store" and addr == SIDBASE and c >= start
+    ]
+    if len(reg0) < len(last):
+        raise ValueError(
+            "%u messages but %u writes of $%04x" % (len(last), len(reg0), SIDBASE)
+        )
+    result = []
+    for k, offset in enumerate(last):
+        read = loads.get(data + offset)
+        if read is None:
+            raise ValueError("message %u was never read" % k)
+        if reg0[k] < read:
+            raise ValueError("message %u written before it was read" % k)
+        result.append(reg0[k] - read)
+    return result, len(stores) / len(last)
+
+
+def summary(lat, writes):
+    lat = sorted(lat)
+    return {
+        "n": len(lat),
+        "min": lat[0],
+        "median": statistics.median(lat),
+        "p90": lat[min(len(lat) - 1, (len(lat) * 9) // 10)],
+        "max": lat[-1],
+        "mean": round(statistics.mean(lat), 1),
+        "sidwrites": round(writes, 1),
+    }
+
+
+def regressions(results, baseline, tolerance, slack):
+    found = []
+    for variant, cmds in results.items():
+        for cmd, modes in cmds.items():
+            for mode, stats in modes.items():
+                try:
+                    base = baseline[variant][cmd][mode]["median"]
+                except KeyError:
+                    continue
+                if stats["median"] > base * (1 + tolerance) + slack:
+                    found.append(
+                        "%s %s %s: median %s -> %s cycles"
+                        % (variant, cmd, mode, base, stats["median"])
+                    )
+    return found
+
+
+# A monitor log captured from a FULL SCRIPT build running fixture_script()
+# (make latency-fixture), so parse_trace() is checked against real VICE output.
+SELFTEST_FIXTURE = os.path.join(os.path.dirname(__file__), "latency-fixture.txt")
+
+
+def fixture_script():
+    """Two noteoff messages, sent one at a time."""
+    return build_script([msg_noteoff(None, seq) for seq in range(2)], 1, True)
+
+
+def selftest():
+    """Check regressions(), and parse_trace() and latencies() against the
+    captured fixture if there is one, without VICE."""
+    _, last = fixture_script()
+    if os.path.exists(SELFTEST_FIXTURE):
+        with open(SELFTEST_FIXTURE) as f:
+            lat, writes = latencies(parse_trace(f.read()), last)
+        if len(lat) != len(last) or min(lat) <= 0 or writes < 1:
+            sys.exit("selftest: got %s, %s writes per message" % (lat, writes))
+    else:
+        print(
+            "selftest: no %s, trace parsing not checked"
+            % os.path.basename(SELFTEST_FIXTURE)
+        )
+    results = {"vap-full": {"noteoff": {"single": {"median": 214}}}}
+    # A median of 214 is over 190 * 1.05 + 8 but not 190 * 1.05 + 16.
+    baseline = {"vap-full": {"noteoff": {"single": {"median": 190}}}}
+    if len(regressions(results, baseline, 0.05, 8)) != 1:
+        sys.exit("selftest: regression not found")
+    if regressions(results, baseline, 0.05, 16):
+        sys.exit("selftest: regression found within tolerance")
+    print("selftest: ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure VAP message to SID write latency under VICE."
+    )
+    parser.add_argument(
+        "prgs", nargs="*", help="SCRIPT builds, FULL if named *full*"
+    )
+    parser.add_argument("--x64sc", default="x64sc", help="command to run VICE")
+    parser.add_argument("--regid", default="regid.h")
+    parser.add_argument("--workdir", default="latency.tmp")
+    parser.add_argument("-o", "--output", default="latency.json")
+    parser.add_argument("--baseline", help="earlier output to check for regressions")
+    parser.add_argument(
+        "--tolerance",
+        type=float,
+        default=0.05,
+        help="allowed median increase, as a fraction",
+    )
+    parser.add_argument(
+        "--slack", type=int, default=8, help="allowed median increase, in cycles"
+    )
+    parser.add_argument(
+        "--selftest",
+        action="store_true",
+        help="check the trace parsing against latency-fixture.txt and exit",
+    )
+    parser.add_argument(
+        "--capture",
+        action="store_true",
+        help="run one FULL build to capture latency-fixture.txt and exit",
+    )
+    args = parser.parse_args()
+
+    if args.selftest:
+        selftest()
+        return
+    if not args.prgs:
+        parser.error("no SCRIPT builds given")
+    os.makedirs(args.workdir, exist_ok=True)
+    if args.capture:
+        script, last = fixture_script()
+        try:
+            trace = run_script(args, args.prgs[0], "fixture", script)
+            latencies(parse_trace(trace), last)
+        except ValueError as err:
+            sys.exit("capture: %s" % err)
+        with open(SELFTEST_FIXTURE, "w") as f:
+            f.write(trace)
+        return
+
+    regidmap = read_regidmap(args.regid)
+    results = {}
+    for prgname in args.prgs:
+        variant = os.path.basename(prgname).replace("-script", "").replace(".prg", "")
+        full = "full" in variant
+        results[variant] = {}
+        for cmd, (encode, fullonly) in sorted(COMMANDS.items()):
+            if fullonly and not full:
+                continue
+            messages = [encode(regidmap, seq) for seq in range(MESSAGES)]
+            results[variant][cmd] = {}
+            for mode, burst in (("single", 1), ("burst", BURST)):
+                script, last = build_script(messages, burst, full)
+                name = "%s-%s-%s" % (variant, cmd, mode)
+                try:
+                    trace = run_script(args, prgname, name, script)
+                    lat, writes = latencies(parse_trace(trace), last)
+                except ValueError as err:
+                    sys.exit("%s %s %s: %s" % (variant, cmd, mode, err))
+                stats = summary(lat, writes)
+                results[variant][cmd][mode] = stats
+                print(
+                    "%-16s %-8s %-6s median %6s p90 %6s max %6s cycles"
+                    % (variant, cmd, mode, stats["median"], stats["p90"], stats["max"])
+                )
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        found = regressions(results, baseline, args.tolerance, args.slack)
+        for r in found:
+            print("REGRESSION %s" % r)
+        if found:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
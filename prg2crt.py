@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+# Wrap a PRG linked at $8000 (see vap-crt.ld) in a CCS64 .crt image for a
+# normal 8K or 16K cartridge, autostarted by the KERNAL via the CBM80 header.
+
+import struct
+import sys
+
+CART_BASE = 0x8000
+CHIP_SIZE = 0x2000
+CBM80 = b"\xc3\xc2\xcd\x38\x30"
+
+
+def prg2crt(prg, name):
+    load = struct.unpack("<H", prg[:2])[0]
+    rom = prg[2:]
+    if load != CART_BASE:
+        raise ValueError("PRG must load at $%04x, not $%04x" % (CART_BASE, load))
+    if rom[4:9] != CBM80:
+        raise ValueError("PRG has no CBM80 cartridge header")
+    if len(rom) > 2 * CHIP_SIZE:
+        raise ValueError("PRG is %u bytes, too large for a 16K cartridge" % len(rom))
+    # 8K carts map ROML only (EXROM low); 16K carts also map ROMH (GAME low).
+    chips = 1 if len(rom) <= CHIP_SIZE else 2
+    exrom, game = 0, 1 if chips == 1 else 0
+    rom = rom.ljust(chips * CHIP_SIZE, b"\xff")
+    header = struct.pack(
+        ">16sIHHBB6x32s",
+        b"C64 CARTRIDGE   ",
+        0x40,
+        0x0100,
+        0,  # normal cartridge
+        exrom,
+        game,
+        name.encode("ascii")[:32],
+    )
+    chip = struct.pack(
+        ">4sIHHHH", b"CHIP", 0x10 + len(rom), 0, 0, CART_BASE, len(rom)
+    )
+    return header + chip + rom
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: %s <in.prg> <out.crt>" % sys.argv[0])
+    with open(sys.argv[1], "rb") as f:
+        prg = f.read()
+    try:
+        crt = prg2crt(prg, "VAP")
+    except ValueError as err:
+        sys.exit("%s: %s" % (sys.argv[1], err))
+    with open(sys.argv[2], "wb") as f:
+        f.write(crt)
+
+
+if __name__ == "__main__":
+    main()
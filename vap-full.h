@@ -27,12 +27,43 @@
 #define UNFIXED_REU_ADDRESSES 0x0
 #define FIX_REU_ADDRESS 0x40
 #define FIX_HOST_ADDRESS 0x80
-
-unsigned char loadmsb = 0;
-unsigned char loadmask = 0;
+#define REU_EXECUTE 0b10000000
+#define REU_NO_FF00 0b00010000
+#define REU_STASH 0b00
+#define REU_FETCH 0b01
+#define REU_AUTOLOAD 0b00100000
+#define REU_FF00 (*((volatile unsigned char *)0xff00))
+#define MIDI_CC 0xb0
+#define CC_DATA_MSB 6
+#define CC_DATA_LSB 38
+#define CC_NRPN_LSB 98
+#define CC_NRPN_MSB 99
+#define CC_RPN_LSB 100
+#define CC_RPN_MSB 101
+// No register selected, as after an RPN select or the RPN null (127/127).
+#define NRPN_NONE 127
+#define CCMAPSIZE 32
+#define BUFFER_SLICE 64
+#define REU_RECT_SLICE 8
+#define CHUNK_SIZE 64
+#define CHUNK_SHIFT 6
+#define CHUNKS 256
+#define VIC_BANK_MASK 0b00000011
+#define VBLANK_LINE 251 // first raster line below the display window
+
+unsigned char loadmsb ZEROPAGE;
+unsigned char loadmask ZEROPAGE;
 unsigned char col = 0;
 volatile unsigned char *bufferaddr = (volatile unsigned char *)RUN_BUFFER;
-volatile unsigned char *loadbuffer = 0;
+volatile unsigned char *loadbuffer ZEROPAGE;
+uint16_t backoffset = 0;
+#ifdef BANKED_BUFFERS
+// R6510 while a buffer command reads or writes the buffer.
+unsigned char bufferport = R6510_DEFAULT;
+#else
+#define bufferport R6510_DEFAULT
+#endif
+unsigned char dbfront = 0;
 
 struct {
   unsigned char start; // number of positions to skip to new row (e.g. 40)
@@ -51,12 +82,102 @@ struct {
   uint16_t count;
 } copyconfig;
 
+// Long buffer operations run a slice at a time from the idle loop, so SID
+// updates arriving meanwhile are still applied on time.
+void (*buffertask)(void) = &noop;
+uint16_t buffercount = 0;
+unsigned char buffercmd = 0;
+
+// Double buffering: buffer commands address buffer 0, and land in whichever
+// buffer is not shown.
+struct {
+  unsigned char addr[2]; // VIC.addr for buffer 0 and 1
+  unsigned char bank[2]; // CIA2 port A VIC bank bits for buffer 0 and 1
+  uint16_t offset;       // buffer 1 address minus buffer 0's, 0 for off
+} dbconfig;
+
+// Chunked loads: each chunk lands at a multiple of CHUNK_SIZE from
+// bufferaddr and is checked against its length and Fletcher-16 sums,
+// recorded in chunkok.
+struct {
+  unsigned char index; // chunk number
+  unsigned char len;   // 1 to CHUNK_SIZE bytes
+  unsigned char sum1;  // sum of the bytes, mod 255
+  unsigned char sum2;  // sum of the running sum1 values, mod 255
+} chunkheader;
+
+unsigned char chunksum1 = 0;
+unsigned char chunksum2 = 0;
+unsigned char chunkleft = 0;
+unsigned char chunkok[CHUNKS / 8];
+
+struct {
+  unsigned char ram; // non-zero to bank out I/O for buffer commands
+} bankconfig;
+
+struct {
+  unsigned char tick; // non-zero to send a SysEx tick every frame
+} frameclockconfig;
+
+unsigned char framecount = 0;
+
+struct ccmapentry {
+  unsigned char reg;   // SID register
+  unsigned char mask;  // register bits set by the controller
+  unsigned char shift; // right shift of the value, scaled to 8 bits, into mask
+};
+
+struct {
+  unsigned char channel;  // MIDI channel (0-15) controlling SID 1, else off
+  unsigned char channel2; // MIDI channel (0-15) controlling SID 2, else off
+  unsigned char map[128]; // CC number to entries index + 1, 0 if unmapped
+  struct ccmapentry entries[CCMAPSIZE];
+} ccconfig;
+
+struct {
+  unsigned char decimation; // acked SysEx per telemetry message, 0 for off
+} telemetryconfig;
+
+struct {
+  unsigned char osc3;
+  unsigned char env3;
+  unsigned char osc3_2;
+  unsigned char env3_2;
+  unsigned char potx;
+  unsigned char poty;
+  unsigned char shadowsum;
+  unsigned char shadowsum2;
+} telemetry;
+
+unsigned char telemetrycount = 0;
+
+unsigned char ccstatus = 0;
+unsigned char ccstatus2 = 0;
+unsigned char ccnum = 0;
+unsigned char nrpnreg = NRPN_NONE;
+unsigned char nrpnmsb = 0;
+unsigned char *ccshadow = sidshadow;
+volatile unsigned char *ccsidbase = SIDBASE;
+
 inline void initfull() {
+  loadmsb = 0;
+  loadmask = 0;
+  loadbuffer = 0;
   memset(&rectconfig, 0, sizeof(rectconfig));
   memset(&fillconfig, 0, sizeof(fillconfig));
   memset(&copyconfig, 0, sizeof(copyconfig));
+  memset(&ccconfig, 0, sizeof(ccconfig));
+  memset(&telemetryconfig, 0, sizeof(telemetryconfig));
+  memset(&bankconfig, 0, sizeof(bankconfig));
+  memset(&frameclockconfig, 0, sizeof(frameclockconfig));
+  dbconfig.addr[0] = dbconfig.addr[1] = VIC_ADDR_DEFAULT;
+  dbconfig.bank[0] = dbconfig.bank[1] = VIC_BANK_MASK;
+  dbconfig.offset = 0;
+  memset(chunkok, 0, sizeof(chunkok));
 }
 
+inline volatile unsigned char *backbuffer() { return bufferaddr + backoffset; }
+
 inline void rect_skip() {
   if (!--col) {
     col = rectconfig.size;
@@ -84,88 +205,313 @@ inline void handle_load_ch(void (*const x)(void)) {
   }
 }
 
-inline void handle_fill_buffer(void (*const x)(void), void (*const y)(void)) {
-  uint16_t j = fillconfig.count;
-  loadbuffer = bufferaddr;
+// Threaded load: unpack ch, then keep taking data bytes straight from buf
+// rather than returning to midiloop() for each. A run ends at a status byte,
+// or when x() moves datahandler off self (NULL if it never does). Loads into
+// the buffer (rather than config) bank once per run, so x() must not touch
+// I/O.
+inline void handle_load_run(void (*const self)(void), void (*const x)(void),
+                            const unsigned char banked) {
+  if (banked) {
+    R6510 = bufferport;
+  }
+  for (;;) {
+    handle_load_ch(x);
+    if (!bufi || (buf[bufi] & 0x80) || (self && datahandler != self)) {
+      break;
+    }
+    ch = buf[bufi--];
+  }
+  if (banked) {
+    R6510 = R6510_DEFAULT;
+  }
+}
+
+void start_buffertask(void (*task)(void)) {
+  buffercmd = cmd + ASID_CMD_FIRST;
+  buffertask = task;
+}
+
+// Tell the host the buffer operation it started has completed.
+void finish_buffertask() {
+  buffertask = &noop;
+  vsysexstart(ASID_CMD_BUFFER_DONE);
+  VW(buffercmd);
+  VW(SYSEX_STOP);
+}
+
+// Run any buffer operation to completion, before starting another that may
+// depend on its result.
+void drain_buffertask() {
+  while (buffertask != &noop) {
+    (*buffertask)();
+    pollframe();
+  }
+}
+
+inline void handle_fill_buffer(void (*const x)(void),
+                               void (*const task)(void)) {
+  buffercount = fillconfig.count;
+  loadbuffer = backbuffer();
   if (x) {
     x();
   }
-  while (j--) {
+  start_buffertask(task);
+}
+
+inline void fill_slice(void (*const y)(void)) {
+  R6510 = bufferport;
+  for (unsigned char n = BUFFER_SLICE; n && buffercount; --n, --buffercount) {
     *(loadbuffer++) = fillconfig.val;
     if (y) {
       y();
     }
   }
+  R6510 = R6510_DEFAULT;
+  if (!buffercount) {
+    finish_buffertask();
+  }
 }
 
-inline void handle_copy_buffer(void (*const x)(void), void (*const y)(void)) {
-  loadbuffer = bufferaddr;
+inline void handle_copy_buffer(void (*const x)(void),
+                               void (*const task)(void)) {
+  loadbuffer = backbuffer();
   if (x) {
     x();
   }
-  while (copyconfig.count--) {
+  start_buffertask(task);
+}
+
+inline void copy_slice(void (*const y)(void)) {
+  R6510 = bufferport;
+  for (unsigned char n = BUFFER_SLICE; n && copyconfig.count;
+       --n, --copyconfig.count) {
     *(loadbuffer++) = *(copyconfig.from++);
     if (y) {
       y();
     }
   }
+  R6510 = R6510_DEFAULT;
+  if (!copyconfig.count) {
+    finish_buffertask();
+  }
 }
 
-void reufetch() { REU_COMMAND = 0b10010001; }
+volatile unsigned char reuprobe;
 
-void reustash() { REU_COMMAND = 0b10010000; }
+inline void reubyte(volatile unsigned char *p, unsigned char bank,
+                    unsigned char type) {
+  *REU_HOST_BASE = (uint16_t)p;
+  REU_ADDR_BASE[2] = bank;
+  REU_COMMAND = REU_EXECUTE | REU_AUTOLOAD | REU_NO_FF00 | type;
+}
 
-inline void manage_reurect(void (*const x)(void)) {
+// Number of 64K REU banks, 0 if none. Stash each bank's number at its start,
+// highest first, so banks that wrap onto lower ones are overwritten, then
+// fetch them back. The first byte of every bank is saved in buf (unused this
+// early) and put back afterwards, so data a host preloaded survives a restart.
+uint16_t detectreu(void) {
+  REU_ADDR_BASE[0] = 0x55;
+  REU_ADDR_BASE[1] = 0xaa;
+  if (REU_ADDR_BASE[0] != 0x55 || REU_ADDR_BASE[1] != 0xaa) {
+    return 0;
+  }
+  REU_ADDR_BASE[0] = 0;
+  REU_ADDR_BASE[1] = 0;
+  *REU_TRANSFER_LEN = 1;
+  REU_CONTROL = UNFIXED_REU_ADDRESSES;
+  unsigned char bank = 0;
+  do {
+    reubyte(&buf[bank], bank, REU_FETCH);
+  } while (++bank);
+  bank = 0xff;
+  do {
+    reuprobe = bank;
+    reubyte(&reuprobe, bank, REU_STASH);
+  } while (bank--);
+  uint16_t banks = 0;
+  do {
+    reubyte(&reuprobe, banks, REU_FETCH);
+  } while (reuprobe == (unsigned char)banks && ++banks < 0x100);
+  bank = 0;
+  do {
+    reubyte(&buf[bank], bank, REU_STASH);
+  } while (++bank);
+  return banks;
+}
+
+inline void reuexec(const unsigned char type) {
+  if (bufferport == R6510_DEFAULT) {
+    REU_COMMAND = REU_EXECUTE | REU_NO_FF00 | type;
+  } else {
+    // Trigger the transfer by writing $FF00 while I/O is banked out, so the
+    // REU reaches the RAM under it.
+    REU_COMMAND = REU_EXECUTE | type;
+    R6510 = bufferport;
+    REU_FF00 = REU_FF00;
+    R6510 = R6510_DEFAULT;
+  }
+}
+
+void reufetch() { reuexec(REU_FETCH); }
+
+void reustash() { reuexec(REU_STASH); }
+
+inline void manage_reurect(void (*const task)(void)) {
   // transfer length must be a multiple of rectconfig.size
-  uint16_t j = *REU_TRANSFER_LEN;
-  while (j) {
+  buffercount = *REU_TRANSFER_LEN;
+  start_buffertask(task);
+}
+
+inline void reurect_slice(void (*const x)(void)) {
+  for (unsigned char n = REU_RECT_SLICE; n && buffercount; --n) {
     // Must reset transfer length on every transfer.
     *REU_TRANSFER_LEN = rectconfig.size;
     x();
-    j -= rectconfig.size;
+    buffercount =
+        buffercount > rectconfig.size ? buffercount - rectconfig.size : 0;
     *REU_HOST_BASE += rectconfig.skip;
   }
+  if (!buffercount) {
+    finish_buffertask();
+  }
 }
 
-void reustashrect() { manage_reurect(reustash); }
+void reustashrectslice() { reurect_slice(reustash); }
+
+void reufetchrectslice() { reurect_slice(reufetch); }
 
-void reufetchrect() { manage_reurect(reufetch); }
+void reustashrect() { manage_reurect(&reustashrectslice); }
+
+void reufetchrect() { manage_reurect(&reufetchrectslice); }
 
 void indirect(void) { asm("jmp (bufferaddr)"); }
 
-void fillbuffer() { handle_fill_buffer(NULL, NULL); }
+void fillslice() { fill_slice(NULL); }
 
-void fillrectbuffer() { handle_fill_buffer(&rect_init, &rect_skip); }
+void fillrectslice() { fill_slice(&rect_skip); }
 
-void copybuffer() { handle_copy_buffer(NULL, NULL); }
+void copyslice() { copy_slice(NULL); }
 
-void copyrectbuffer() { handle_copy_buffer(&rect_init, &rect_skip); }
+void copyrectslice() { copy_slice(&rect_skip); }
 
-void handle_load() { handle_load_ch(NULL); }
+void fillbuffer() { handle_fill_buffer(NULL, &fillslice); }
 
-void handle_rect_load() { handle_load_ch(&rect_skip); }
+void fillrectbuffer() { handle_fill_buffer(&rect_init, &fillrectslice); }
 
-void start_handle_load() {
+void copybuffer() { handle_copy_buffer(NULL, &copyslice); }
+
+void copyrectbuffer() { handle_copy_buffer(&rect_init, &copyrectslice); }
+
+void handle_load() { handle_load_run(NULL, NULL, 0); }
+
+// Start loading a config struct from the following data bytes.
+inline void start_config_load(volatile void *p) {
   loadmsb = 0;
   datahandler = &handle_load;
-  loadbuffer = bufferaddr;
+  loadbuffer = (volatile unsigned char *)p;
+  setasidstop();
+}
+
+void handle_buffer_load() { handle_load_run(NULL, NULL, 1); }
+
+void handle_rect_load() { handle_load_run(NULL, &rect_skip, 1); }
+
+void start_handle_load() {
+  loadmsb = 0;
+  datahandler = &handle_buffer_load;
+  loadbuffer = backbuffer();
   setasidstop();
 }
 
 void start_handle_load_rect() {
-  datahandler = &handle_load;
-  loadbuffer = bufferaddr;
+  loadmsb = 0;
+  loadbuffer = backbuffer();
   datahandler = &handle_rect_load;
   rect_init();
   setasidstop();
 }
 
-void start_handle_addr() {
-  datahandler = &handle_load;
-  loadbuffer = (unsigned char *)&bufferaddr;
+// Add mod 255 with end around carry. 255 stands for 0, see chunksumok().
+inline unsigned char add255(unsigned char a, unsigned char b) {
+  uint16_t t = a + b;
+  return (unsigned char)t + (unsigned char)(t >> 8);
+}
+
+void chunk_data_byte() {
+  chunksum1 = add255(chunksum1, ch);
+  chunksum2 = add255(chunksum2, chunksum1);
+  if (!--chunkleft) {
+    datahandler = &noop;
+  }
+}
+
+void handle_chunk_data() {
+  handle_load_run(&handle_chunk_data, &chunk_data_byte, 1);
+}
+
+void chunk_header_byte() {
+  if (loadbuffer == (unsigned char *)&chunkheader + sizeof(chunkheader)) {
+    if (!chunkheader.len || chunkheader.len > CHUNK_SIZE) {
+      datahandler = &noop; // bad length: chunkleft stays non-zero
+      return;
+    }
+    chunkleft = chunkheader.len;
+    loadbuffer =
+        backbuffer() + ((uint16_t)chunkheader.index << CHUNK_SHIFT);
+    datahandler = &handle_chunk_data;
+  }
+}
+
+void handle_chunk_header() {
+  handle_load_run(&handle_chunk_header, &chunk_header_byte, 0);
+}
+
+void start_handle_chunk() {
+  loadmsb = 0;
+  chunksum1 = 0;
+  chunksum2 = 0;
+  chunkleft = 1;
+  datahandler = &handle_chunk_header;
+  loadbuffer = (unsigned char *)&chunkheader;
   setasidstop();
 }
 
+inline unsigned char chunksumok(unsigned char sum, unsigned char expected) {
+  return (sum == 0xff ? 0 : sum) == expected;
+}
+
+// A chunk is good only if all the bytes its header promised arrived, with
+// matching sums. Fletcher-16 (unlike a plain sum) sees dropped or reordered
+// bytes, even zeros.
+void calcchunk() {
+  if (datahandler == &handle_chunk_header) {
+    return; // truncated header
+  }
+  unsigned char bit = 1 << (chunkheader.index & 7);
+  unsigned char *ok = &chunkok[chunkheader.index >> 3];
+  if (!chunkleft && chunksumok(chunksum1, chunkheader.sum1) &&
+      chunksumok(chunksum2, chunkheader.sum2)) {
+    *ok |= bit;
+  } else {
+    *ok &= ~bit;
+  }
+}
+
+// Report which chunks have loaded with a good sum, one bit per chunk.
+void sendchunks() {
+  vsysexstart(ASID_CMD_CHUNK_STATUS);
+  vsendpacked(chunkok, sizeof(chunkok));
+  VW(SYSEX_STOP);
+}
+
+// A new buffer address starts a new chunked load.
+void resetchunks() { memset(chunkok, 0, sizeof(chunkok)); }
+
+void start_handle_addr() {
+  start_config_load(&bufferaddr);
+}
+
 void calcrect() {
   unsigned char i = rectconfig.inc;
   rectconfig.skip = 0;
@@ -175,17 +521,13 @@ void calcrect() {
 }
 
 void start_handle_addr_rect() {
-  datahandler = &handle_load;
-  loadbuffer = (unsigned char *)&rectconfig;
-  setasidstop();
+  start_config_load(&rectconfig);
 }
 
 inline void start_reu(uint8_t control) {
-  datahandler = &handle_load;
-  loadbuffer = REU_ADDR_BASE;
   REU_CONTROL = control;
-  *(uint16_t *)REU_HOST_BASE = (uint16_t)bufferaddr;
-  setasidstop();
+  *(uint16_t *)REU_HOST_BASE = (uint16_t)backbuffer();
+  start_config_load(REU_ADDR_BASE);
 }
 
 void start_handle_reu() { start_reu(UNFIXED_REU_ADDRESSES); }
@@ -193,13 +535,292 @@ void start_handle_reu() { start_reu(UNFIXED_REU_ADDRESSES); }
 void start_handle_reu_fill() { start_reu(FIX_REU_ADDRESS); }
 
 void start_handle_copy() {
-  datahandler = &handle_load;
-  loadbuffer = (unsigned char *)&copyconfig;
-  setasidstop();
+  start_config_load(&copyconfig);
 }
 
 void start_handle_fill() {
-  datahandler = &handle_load;
-  loadbuffer = (unsigned char *)&fillconfig;
+  start_config_load(&fillconfig);
+}
+
+void showfront() {
+  VIC.addr = dbconfig.addr[dbfront];
+  PORTA = (PORTA & ~VIC_BANK_MASK) | (dbconfig.bank[dbfront] & VIC_BANK_MASK);
+}
+
+void start_handle_db() {
+  start_config_load(&dbconfig);
+}
+
+void calcdb() {
+  dbfront = 0;
+  backoffset = dbconfig.offset;
+  showfront();
+}
+
+// Swap front and back buffers once the raster is below the display window,
+// so no frame shows part of each.
+void flipslice() {
+  if (!(VIC.ctrl1 & 0x80) && VIC.rasterline < VBLANK_LINE) {
+    return;
+  }
+  dbfront ^= 1;
+  showfront();
+  backoffset = dbfront ? 0 : dbconfig.offset;
+  finish_buffertask();
+}
+
+void flipbuffer() { start_buffertask(&flipslice); }
+
+#ifdef BANKED_BUFFERS
+void start_handle_bank() {
+  start_config_load(&bankconfig);
+}
+
+void calcbank() { bufferport = bankconfig.ram ? R6510_RAM : R6510_DEFAULT; }
+
+#define ASID_BANK_CMDS(X) X(ASID_CMD_BANK_BUFFER, &start_handle_bank, &calcbank)
+#else
+#define ASID_BANK_CMDS(X)
+#endif
+
+// CCs are ignored until calcccmap() has checked the new table.
+void start_handle_ccmap() {
+  ccstatus = 0;
+  ccstatus2 = 0;
+  start_config_load(&ccconfig);
+}
+
+void start_handle_telemetry() {
+  start_config_load(&telemetryconfig);
+}
+
+void calctelemetry() { telemetrycount = telemetryconfig.decimation; }
+
+unsigned char shadowsum(const unsigned char *shadow) {
+  unsigned char sum = 0;
+  for (unsigned char i = 0; i < SIDREGSIZE; ++i) {
+    sum += shadow[i];
+  }
+  return sum;
+}
+
+// Called once per frame from pollframe(): every telemetryconfig.decimation'th
+// frame, report the SID read registers and shadow checksums in one SysEx.
+void sendtelemetry() {
+  if (!telemetrycount || --telemetrycount) {
+    return;
+  }
+  telemetrycount = telemetryconfig.decimation;
+  telemetry.osc3 = SIDBASE[SIDOSC3];
+  telemetry.env3 = SIDBASE[SIDENV3];
+  telemetry.osc3_2 = SIDBASE2[SIDOSC3];
+  telemetry.env3_2 = SIDBASE2[SIDENV3];
+  telemetry.potx = SIDBASE[SIDPOTX];
+  telemetry.poty = SIDBASE[SIDPOTY];
+  telemetry.shadowsum = shadowsum(sidshadow);
+  telemetry.shadowsum2 = shadowsum(sidshadow2);
+  vsysexstart(ASID_CMD_TELEMETRY);
+  vsendpacked((const unsigned char *)&telemetry, sizeof(telemetry));
+  VW(SYSEX_STOP);
+}
+
+// State a reconnecting host needs: both SID shadows and the buffer setup.
+// Snapshots send each segment packed separately, so restores start a new mask
+// group with each segment.
+struct snapshotseg {
+  unsigned char *p;
+  unsigned char size;
+};
+
+const struct snapshotseg snapshotsegs[] = {
+    {sidshadow, sizeof(sidshadow)},
+    {sidshadow2, sizeof(sidshadow2)},
+    {(unsigned char *)&rectconfig, sizeof(rectconfig)},
+    {(unsigned char *)&bufferaddr, sizeof(bufferaddr)},
+};
+
+#define SNAPSHOT_SEGS (sizeof(snapshotsegs) / sizeof(snapshotsegs[0]))
+
+unsigned char snapshotseg = 0;
+unsigned char snapshotleft = 0;
+
+void sendsnapshot() {
+  vsysexstart(ASID_CMD_SNAPSHOT);
+  for (unsigned char i = 0; i < SNAPSHOT_SEGS; ++i) {
+    vsendpacked(snapshotsegs[i].p, snapshotsegs[i].size);
+  }
+  VW(SYSEX_STOP);
+}
+
+inline void restore_seg() {
+  loadmsb = 0;
+  loadbuffer = snapshotsegs[snapshotseg].p;
+  snapshotleft = snapshotsegs[snapshotseg].size;
+}
+
+inline void restore_byte() {
+  if (!--snapshotleft) {
+    if (++snapshotseg == SNAPSHOT_SEGS) {
+      datahandler = &noop;
+    } else {
+      restore_seg();
+    }
+  }
+}
+
+void handle_restore() { handle_load_run(&handle_restore, &restore_byte, 0); }
+
+void start_handle_restore() {
+  snapshotseg = 0;
+  restore_seg();
+  datahandler = &handle_restore;
   setasidstop();
 }
+
+// Only a complete restore reaches the SIDs, in one pass over both.
+void calcrestore() {
+  if (snapshotseg == SNAPSHOT_SEGS) {
+    flushsids();
+  }
+}
+
+void start_handle_frameclock() {
+  start_config_load(&frameclockconfig);
+}
+
+// CIA1 timer A underflows once per frame (see set_cia_timer()). Reading ICR
+// clears the flag. Polled when idle and after each acked SysEx, so frames are
+// only merged when VAP is busy for more than a frame at a time.
+void pollframe() {
+  if (CIA1.icr & 0x01) {
+    ++framecount;
+    if (frameclockconfig.tick) {
+      vsysexstart(ASID_CMD_FRAME_CLOCK);
+      VW(framecount & 0x7f);
+      VW(SYSEX_STOP);
+    }
+    sendtelemetry();
+  }
+}
+
+// Called from midiloop() when no MIDI input is waiting.
+inline void idle() {
+  pollframe();
+  (*buffertask)();
+}
+
+inline unsigned char ccchannelstatus(unsigned char channel) {
+  return channel < 16 ? MIDI_CC | channel : 0;
+}
+
+// Drop map values past the entries and entries past the SID registers, so
+// handle_cc_val() can use the table unchecked.
+void calcccmap() {
+  unsigned char i;
+  for (i = 0; i < sizeof(ccconfig.map); ++i) {
+    if (ccconfig.map[i] > CCMAPSIZE) {
+      ccconfig.map[i] = 0;
+    }
+  }
+  for (i = 0; i < CCMAPSIZE; ++i) {
+    if (ccconfig.entries[i].reg >= SIDREGSIZE) {
+      ccconfig.entries[i].mask = 0;
+      ccconfig.entries[i].reg = 0;
+    }
+  }
+  ccstatus = ccchannelstatus(ccconfig.channel);
+  ccstatus2 = ccchannelstatus(ccconfig.channel2);
+}
+
+inline void ccwrite(unsigned char reg, unsigned char val) {
+  ccshadow[reg] = val;
+  ccsidbase[reg] = val;
+}
+
+void handle_cc_num();
+
+// Controllers in ccconfig.map set register bits directly. NRPN (LSB only)
+// selects a register and data entry writes it, the LSB triggering the write:
+// B0 62 <reg> then B0 06 <msb> 26 <lsb> (or 26 <lsb> alone with running
+// status and an unchanged MSB). NRPN MSB (sent before the LSB) and RPN selects
+// deselect the register, so RPN data entry writes nothing.
+void handle_cc_val() {
+  datahandler = &handle_cc_num;
+  switch (ccnum) {
+  case CC_NRPN_LSB:
+    nrpnreg = ch;
+    break;
+  case CC_NRPN_MSB:
+  case CC_RPN_LSB:
+  case CC_RPN_MSB:
+    nrpnreg = NRPN_NONE;
+    break;
+  case CC_DATA_MSB:
+    nrpnmsb = ch;
+    break;
+  case CC_DATA_LSB:
+    if (nrpnreg < SIDREGSIZE) {
+      ccwrite(nrpnreg, (nrpnmsb << 7) | ch);
+    }
+    break;
+  default: {
+    unsigned char i = ccconfig.map[ccnum];
+    if (i) {
+      struct ccmapentry *e = &ccconfig.entries[i - 1];
+      unsigned char val = ch << 1;
+      for (unsigned char j = e->shift; j; --j) {
+        val >>= 1;
+      }
+      ccwrite(e->reg, (ccshadow[e->reg] & ~e->mask) | (val & e->mask));
+    }
+  } break;
+  }
+}
+
+void handle_cc_num() {
+  ccnum = ch;
+  datahandler = &handle_cc_val;
+}
+
+// Called for channel status bytes: start a CC (with running status) if the
+// channel is mapped to a SID, otherwise ignore the message's data bytes.
+inline void handle_channel_status() {
+  if (ch == ccstatus) {
+    ccshadow = sidshadow;
+    ccsidbase = SIDBASE;
+    datahandler = &handle_cc_num;
+  } else if (ch == ccstatus2) {
+    ccshadow = sidshadow2;
+    ccsidbase = SIDBASE2;
+    datahandler = &handle_cc_num;
+  } else if (ch < SYSEX_START) {
+    datahandler = &noop;
+  }
+}
+
+#define ASID_FULL_CMDS(X)                                                      \
+  X(ASID_CMD_RUN_BUFFER, &setasidstop, &indirect)                              \
+  X(ASID_CMD_LOAD_BUFFER, &start_handle_load, &noop)                           \
+  X(ASID_CMD_ADDR_BUFFER, &start_handle_addr, &resetchunks)                    \
+  X(ASID_CMD_LOAD_RECT_BUFFER, &start_handle_load_rect, &noop)                 \
+  X(ASID_CMD_ADDR_RECT_BUFFER, &start_handle_addr_rect, &calcrect)             \
+  X(ASID_CMD_FILL_BUFFER, &start_handle_fill, &fillbuffer)                     \
+  X(ASID_CMD_FILL_RECT_BUFFER, &start_handle_fill, &fillrectbuffer)            \
+  X(ASID_CMD_COPY_BUFFER, &start_handle_copy, &copybuffer)                     \
+  X(ASID_CMD_COPY_RECT_BUFFER, &start_handle_copy, &copyrectbuffer)            \
+  X(ASID_CMD_REU_STASH_BUFFER, &start_handle_reu, &reustash)                   \
+  X(ASID_CMD_REU_FETCH_BUFFER, &start_handle_reu, &reufetch)                   \
+  X(ASID_CMD_REU_FILL_BUFFER, &start_handle_reu_fill, &reufetch)               \
+  X(ASID_CMD_REU_STASH_BUFFER_RECT, &start_handle_reu, &reustashrect)          \
+  X(ASID_CMD_REU_FETCH_BUFFER_RECT, &start_handle_reu, &reufetchrect)          \
+  X(ASID_CMD_REU_FILL_BUFFER_RECT, &start_handle_reu_fill, &reufetchrect)      \
+  X(ASID_CMD_LOAD_CC_MAP, &start_handle_ccmap, &calcccmap)                     \
+  X(ASID_CMD_TELEMETRY, &start_handle_telemetry, &calctelemetry)               \
+  X(ASID_CMD_DOUBLE_BUFFER, &start_handle_db, &calcdb)                         \
+  X(ASID_CMD_FLIP_BUFFER, &setasidstop, &flipbuffer)                           \
+  X(ASID_CMD_LOAD_CHUNK, &start_handle_chunk, &calcchunk)                      \
+  X(ASID_CMD_CHUNK_STATUS, &setasidstop, &sendchunks)                          \
+  X(ASID_CMD_FRAME_CLOCK, &start_handle_frameclock, &noop)                     \
+  X(ASID_CMD_SNAPSHOT, &setasidstop, &sendsnapshot)                            \
+  X(ASID_CMD_RESTORE, &start_handle_restore, &calcrestore)                     \
+  ASID_BANK_CMDS(X)
@@ -33,21 +33,58 @@
 #endif
 
 #ifdef POLL
-#define VAP_NAME VAP_BASE_NAME "-POLL"
+#define VAP_POLL_NAME VAP_BASE_NAME "-POLL"
 #else
-#define VAP_NAME VAP_BASE_NAME
+#define VAP_POLL_NAME VAP_BASE_NAME
+#endif
+
+#ifdef CART
+#define VAP_NAME VAP_POLL_NAME "-CRT"
+#else
+#define VAP_NAME VAP_POLL_NAME
 #endif
 
 const char VAP_VERSION[] = VAP_NAME VERSION;
 
 #define SCREENMEM ((volatile unsigned char *)0x0400)
+#define VIC_ADDR_DEFAULT 0b00010110
 #define SIDBASE ((volatile unsigned char *)0xd400)
 #define SIDBASE2 ((volatile unsigned char *)0xd420)
 #define SIDCTRL 4
+#define SIDPOTX 0x19
+#define SIDPOTY 0x1a
+#define SIDOSC3 0x1b
+#define SIDENV3 0x1c
 #define R6510 (*(volatile unsigned char *)0x01)
 #define SIDREGSIZE 28
 #define NMI_VECTOR (*((volatile uint16_t *)0xfffa))
 #define IRQ_VECTOR (*((volatile uint16_t *)0xfffe))
+#define KERNAL_NMI_VECTOR (*((volatile uint16_t *)0x0318))
+
+#ifdef CART
+// Cartridge ROM runs the code, so %111 keeps the power-on map: ROML at $8000,
+// BASIC at $A000 for an 8K image (ROMH for 16K), I/O at $D000 and KERNAL at
+// $E000. KERNAL dispatches NMI via $0318.
+#define R6510_DEFAULT 0b00000111
+#else
+// disable kernal + basic, makes new handlers visible
+#define R6510_DEFAULT 0b00000101
+#endif
+// all RAM, for buffer commands reaching under I/O
+#define R6510_RAM 0b00000100
+
+// Buffer commands can bank out I/O, so interrupt handlers must bank it back
+// in. Not in the cartridge build, whose code would be banked out too.
+#if defined(FULL) && !defined(CART)
+#define BANKED_BUFFERS
+#define IO_IN                                                                  \
+  unsigned char port = R6510;                                                  \
+  R6510 = R6510_DEFAULT;
+#define IO_OUT R6510 = port;
+#else
+#define IO_IN
+#define IO_OUT
+#endif
 
 #define MIDI_CLOCK 0xF8
 #define SYSEX_START 0xf0
@@ -80,29 +117,62 @@ enum ASID_CMD {
   ASID_CMD_REU_FETCH_BUFFER_RECT = 0x5f,
   ASID_CMD_REU_FILL_BUFFER_RECT = 0x60,
   // TODO: REU fetch to rectangle.
+  ASID_CMD_LOAD_CC_MAP = 0x61,
+  ASID_CMD_TELEMETRY = 0x62,
+  ASID_CMD_BUFFER_DONE = 0x63,
+  ASID_CMD_DOUBLE_BUFFER = 0x64,
+  ASID_CMD_FLIP_BUFFER = 0x65,
+  ASID_CMD_LOAD_CHUNK = 0x66,
+  ASID_CMD_CHUNK_STATUS = 0x67,
+  ASID_CMD_BANK_BUFFER = 0x68,
+  ASID_CMD_FRAME_CLOCK = 0x69,
+  ASID_CMD_CAPS = 0x6a,
+  ASID_CMD_SNAPSHOT = 0x6b,
   ASID_CMD_UPDATE_REG = 0x6c,
   ASID_CMD_UPDATE2_REG = 0x6d,
+  ASID_CMD_RESTORE = 0x6e,
+  ASID_CMD_VISUALISER = 0x6f,
 };
 
+#define ASID_CMD_FIRST ASID_CMD_START
+
 #define ACK_VIC_IRQ asm("asl %[r]" : : [r] "i"((const uint16_t) & (VIC.irr)));
 #define ACK_CIA_IRQ(X) asm("bit %[r]" : : [r] "i"((const uint16_t) & (X)));
 #define ACK_CIA1_IRQ ACK_CIA_IRQ(CIA1.icr)
 #define ACK_CIA2_IRQ ACK_CIA_IRQ(CIA2.icr)
 const unsigned char sidregs = 25;
 
-unsigned char buf[255] = {};
+// Decoder state touched for every byte received, in zero page. It is not
+// zeroed at startup; init() sets it.
+#define ZEROPAGE __attribute__((section(".zp.bss")))
+
+// Indexed 1 to 255 by the Vessel byte count.
+unsigned char buf[256] = {};
+unsigned char bufi ZEROPAGE;
 unsigned char cmd = 0;
 unsigned char reg = 0;
-volatile unsigned char ch = 0;
+unsigned char ch ZEROPAGE;
 volatile unsigned char nmi_in = 0;
+#ifdef SCRIPT
+// A script raises no NMIs, so input is pending until the script runs out.
+#define NMI_PENDING(ack) ((void)(ack), scriptpos < SCRIPT_LEN)
+#else
+#define NMI_PENDING(ack) (nmi_in != (ack))
+#endif
 
 unsigned char sidshadow[sizeof(regidmap)] = {};
 unsigned char sidshadow2[sizeof(regidmap)] = {};
 
 void noop() {}
-void (*datahandler)(void) = &noop;
+void (*datahandler)(void) ZEROPAGE;
 void (*stophandler)(void) = &noop;
-void (*const asidstopcmdhandler[])(void);
+
+struct asidcmd {
+  void (*start)(void);
+  void (*stop)(void);
+};
+
+extern const struct asidcmd asidcmdhandler[];
 
 volatile struct {
 #ifndef FULL
@@ -124,16 +194,61 @@ typedef volatile struct asidregupdate {
 
 asidregupdatetype *const asidregupdatep = (asidregupdatetype *const)&asidupdate;
 
+#ifdef FULL
+void flushsids();
+void pollframe();
+#endif
+
 void asidstop() {
-  (*asidstopcmdhandler[cmd])();
+  (*asidcmdhandler[cmd].stop)();
   CLOCK_ACK;
   datahandler = &noop;
   stophandler = &noop;
+#ifdef FULL
+  pollframe();
+#endif
 }
 
 void setasidstop() { stophandler = &asidstop; }
 
-void handle_loadupdate() { ((unsigned char *)&asidupdate)[reg++] = ch; }
+void vsysexstart(unsigned char c) {
+  VW(SYSEX_START);
+  VW(ASID_MANID);
+  VW(c);
+}
+
+// Send n bytes over Vessel, packed as handle_load_ch() unpacks them: a mask
+// byte holding the MSBs of up to 7 following 7-bit bytes.
+void vsendpacked(const unsigned char *p, unsigned char n) {
+  while (n) {
+    unsigned char group = n < 7 ? n : 7;
+    unsigned char mask = 0;
+    unsigned char j = 0;
+    for (j = 0; j < group; ++j) {
+      if (p[j] & 0x80) {
+        mask |= 1 << j;
+      }
+    }
+    VW(mask);
+    for (j = 0; j < group; ++j) {
+      VW(p[j] & 0x7f);
+    }
+    p += group;
+    n -= group;
+  }
+}
+
+// Threaded like handle_load_run(): copy data bytes straight from buf until a
+// status byte or the end of what Vessel delivered.
+void handle_loadupdate() {
+  for (;;) {
+    ((unsigned char *)&asidupdate)[reg++] = ch;
+    if (!bufi || (buf[bufi] & 0x80)) {
+      break;
+    }
+    ch = buf[bufi--];
+  }
+}
 
 #ifdef FULL
 #include "vap-full.h"
@@ -150,7 +265,8 @@ void handle_loadupdate() { ((unsigned char *)&asidupdate)[reg++] = ch; }
   SHADOWREG(b, shadow, 6 + i);                                                 \
   SHADOWREG(b, shadow, 4 + i);
 
-inline void sidfromshadow(unsigned char *shadow, volatile unsigned char *b) {
+static inline void sidfromshadow(unsigned char *shadow,
+                                 volatile unsigned char *b) {
   SIDFROMSHADOW(b, shadow, 0);
   SIDFROMSHADOW(b, shadow, 7);
   SIDFROMSHADOW(b, shadow, 14);
@@ -160,7 +276,7 @@ inline void sidfromshadow(unsigned char *shadow, volatile unsigned char *b) {
   SHADOWREG(b, shadow, 24);
 }
 
-inline void asidupdateregsid(unsigned char *shadow) {
+static inline void asidupdateregsid(unsigned char *shadow) {
   for (unsigned char j = 0; asidregupdatep->updates[j] != SYSEX_STOP; j += 2) {
     if (asidregupdatep->updates[j] & 0x40) {
       (asidregupdatep->updates[j + 1]) |= 0x80;
@@ -170,65 +286,61 @@ inline void asidupdateregsid(unsigned char *shadow) {
   }
 }
 
+// Decode one mask group of an 0x4e/0x50 update. regidmap is only indexed
+// with constants, so each register costs a bit test, a load and a store to a
+// fixed shadow register, with no variable shifts or table walks.
+#define UPDATEREG(shadow, i, j)                                                \
+  if (mask & (1 << j)) {                                                       \
+    unsigned char val = asidupdate.lsb[lsbp++];                                \
+    if (msb & (1 << j)) {                                                      \
+      val |= 0x80;                                                             \
+    }                                                                          \
+    shadow[regidmap[(i * 7) + j]] = val;                                       \
+  }
+
+#define UPDATEREGS(shadow, i)                                                  \
+  mask = asidupdate.mask[i];                                                   \
+  if (mask) {                                                                  \
+    msb = asidupdate.msb[i];                                                   \
+    UPDATEREG(shadow, i, 0);                                                   \
+    UPDATEREG(shadow, i, 1);                                                   \
+    UPDATEREG(shadow, i, 2);                                                   \
+    UPDATEREG(shadow, i, 3);                                                   \
+    UPDATEREG(shadow, i, 4);                                                   \
+    UPDATEREG(shadow, i, 5);                                                   \
+    UPDATEREG(shadow, i, 6);                                                   \
+  }
+
 void asidupdatesid(unsigned char *shadow) {
   unsigned char lsbp = 0;
-  unsigned char i = 0;
-  unsigned char j = 0;
-  unsigned char regid = 0;
-#pragma unroll
-  for (i = 0; i < 4; ++i, regid += 7) {
-    unsigned char mask = asidupdate.mask[i];
-    if (mask) {
-      unsigned char msb = asidupdate.msb[i];
-      for (j = 0; j < 7; ++j) {
-        unsigned char bit = 1 << j;
-        if (mask & bit) {
-          unsigned char reg = regidmap[regid + j];
-          unsigned char val = asidupdate.lsb[lsbp++];
-          if (msb & bit) {
-            val |= 0x80;
-          }
-          shadow[reg] = val;
-        }
-      }
-    }
-  }
+  unsigned char mask = 0;
+  unsigned char msb = 0;
+  UPDATEREGS(shadow, 0);
+  UPDATEREGS(shadow, 1);
+  UPDATEREGS(shadow, 2);
+  UPDATEREGS(shadow, 3);
+}
+
+#ifdef FULL
+void flushsids() {
+  sidfromshadow(sidshadow, SIDBASE);
+  sidfromshadow(sidshadow2, SIDBASE2);
 }
+#endif
 
 void initsid(void) {
   unsigned char i = 0;
   for (i = 0; i < SIDREGSIZE; ++i) {
     sidshadow[i] = 0;
+    sidshadow2[i] = 0;
   }
   sidfromshadow(sidshadow, SIDBASE);
-  sidfromshadow(sidshadow, SIDBASE2);
+  sidfromshadow(sidshadow2, SIDBASE2);
 }
 
 void updatesid() {
-#ifndef FULL
-#define GATESTATES                                                             \
-  (sidshadow[SIDCTRL] & 0x1) + ((sidshadow[SIDCTRL + 7] & 0x1) << 1) +         \
-      ((sidshadow[SIDCTRL + 14] & 0x1) << 2)
-  unsigned char beforegate = GATESTATES;
-#endif
-
   asidupdatesid(sidshadow);
   sidfromshadow(sidshadow, SIDBASE);
-
-#ifndef FULL
-  unsigned char aftergate = GATESTATES;
-
-  // Any gate 0->1 ?
-  if ((((beforegate & 1) == 0) && ((aftergate & 1) == 1)) |
-      (((beforegate & 2) == 0) && ((aftergate & 2) == 2)) |
-      (((beforegate & 4) == 0) && ((aftergate & 4) == 4))) {
-    VIC.ctrl2 = (nmi_in ^ sidshadow[0]) + sidshadow[SIDCTRL];
-    VIC.addr = (nmi_in ^ sidshadow[7]) + sidshadow[7 + SIDCTRL];
-    // avoid disabling screen.
-    VIC.ctrl1 = ((nmi_in ^ sidshadow[14 + SIDCTRL]) | 0x10) & 0b10111111;
-    VIC.bordercolor = nmi_in + sidshadow[14 + SIDCTRL];
-  }
-#endif
 }
 
 void updatesid2() {
@@ -241,18 +353,101 @@ void updatebothsid() {
   sidfromshadow(sidshadow, SIDBASE2);
 }
 
-#define UPDATEREGVAL(B)                                                        \
+#ifndef FULL
+// Visualiser, run from midiloop() when idle so updates only do SID work. Each
+// call looks at one voice of the first SID: a gate 0->1 flashes the VIC as
+// before, and a bar on the bottom rows shows the voice's sustain level while
+// its gate is on.
+#define VIS_ROW 22
+#define VIS_BAR 0xa0 // reverse space
+#define VIS_EMPTY 0x20
+
+unsigned char vison = 1;
+unsigned char visvoice = 0;
+unsigned char visgates = 0;
+unsigned char vislevels[3] = {};
+
+inline volatile unsigned char *visbar(unsigned char voice) {
+  return SCREENMEM + (VIS_ROW + voice) * 40;
+}
+
+void visbarlevel(unsigned char voice, unsigned char level) {
+  volatile unsigned char *bar = visbar(voice);
+  unsigned char i = 0;
+  for (; i < level; ++i) {
+    bar[i] = VIS_BAR;
+  }
+  for (; i < 15; ++i) {
+    bar[i] = VIS_EMPTY;
+  }
+  vislevels[voice] = level;
+}
+
+void vis() {
+  if (!vison) {
+    return;
+  }
+  unsigned char v = visvoice;
+  unsigned char ctrl = sidshadow[v * 7 + SIDCTRL];
+  unsigned char gate = 1 << v;
+  unsigned char level = 0;
+  if (ctrl & 0x1) {
+    level = sidshadow[v * 7 + 6] >> 4;
+    if (!(visgates & gate)) {
+      visgates |= gate;
+      VIC.ctrl2 = (nmi_in ^ sidshadow[0]) + sidshadow[SIDCTRL];
+      VIC.addr = (nmi_in ^ sidshadow[7]) + sidshadow[7 + SIDCTRL];
+      // avoid disabling screen.
+      VIC.ctrl1 = ((nmi_in ^ sidshadow[14 + SIDCTRL]) | 0x10) & 0b10111111;
+      VIC.bordercolor = nmi_in + sidshadow[14 + SIDCTRL];
+    }
+  } else {
+    visgates &= ~gate;
+  }
+  if (level != vislevels[v]) {
+    visbarlevel(v, level);
+  }
+  visvoice = v == 2 ? 0 : v + 1;
+}
+
+void resetvic();
+
+void setvis(unsigned char on) {
+  if (on == vison) {
+    return;
+  }
+  vison = on;
+  if (!on) {
+    for (unsigned char v = 0; v < 3; ++v) {
+      visbarlevel(v, 0);
+    }
+    visgates = 0;
+    resetvic();
+  }
+}
+#endif
+
+#define UPDATEREGVAL(shadow, B)                                                \
   if (reg & (1 << 6)) {                                                        \
     reg &= ((1 << 6) - 1);                                                     \
     ch |= 0x80;                                                                \
   }                                                                            \
-  sidshadow[reg] = ch;                                                         \
+  shadow[reg] = ch;                                                            \
   B[reg] = ch;
 
-#define UPDATESHADOW(S, R, V, B)                                               \
+// Register/value pairs run threaded: while whole pairs are waiting in buf,
+// V takes them directly rather than returning to midiloop() for each byte.
+#define UPDATESHADOW(S, R, V, shadow, B)                                       \
   void R();                                                                    \
   void V() {                                                                   \
-    UPDATEREGVAL(B);                                                           \
+    for (;;) {                                                                 \
+      UPDATEREGVAL(shadow, B);                                                 \
+      if (bufi < 2 || ((buf[bufi] | buf[bufi - 1]) & 0x80)) {                  \
+        break;                                                                 \
+      }                                                                        \
+      reg = buf[bufi--];                                                       \
+      ch = buf[bufi--];                                                        \
+    }                                                                          \
     datahandler = &R;                                                          \
   }                                                                            \
   void R() {                                                                   \
@@ -264,13 +459,14 @@ void updatebothsid() {
     setasidstop();                                                             \
   }
 
-UPDATESHADOW(start_handle_reg, handle_reg, handle_val, SIDBASE);
-UPDATESHADOW(start_handle_reg2, handle_reg2, handle_val2, SIDBASE2);
+UPDATESHADOW(start_handle_reg, handle_reg, handle_val, sidshadow, SIDBASE);
+UPDATESHADOW(start_handle_reg2, handle_reg2, handle_val2, sidshadow2,
+             SIDBASE2);
 
 void handle_single_reg();
 
 void handle_single_val() {
-  UPDATEREGVAL(SIDBASE);
+  UPDATEREGVAL(sidshadow, SIDBASE);
   datahandler = &handle_single_reg;
 }
 
@@ -282,7 +478,7 @@ void handle_single_reg() {
 void handle_single_reg2();
 
 void handle_single_val2() {
-  UPDATEREGVAL(SIDBASE2);
+  UPDATEREGVAL(sidshadow2, SIDBASE2);
   datahandler = &handle_single_reg2;
 }
 
@@ -294,7 +490,11 @@ void handle_single_reg2() {
 void resetvic() {
   VIC.ctrl1 = 0b00011011;
   VIC.ctrl2 = 0b00001000;
-  VIC.addr = 0b00010110;
+#ifdef FULL
+  showfront();
+#else
+  VIC.addr = VIC_ADDR_DEFAULT;
+#endif
   VIC.bordercolor = 0x0e;
 }
 
@@ -315,280 +515,63 @@ void handleupdate() {
   setasidstop();
 }
 
-#ifdef FULL
-#define HANDLE_FULL(X) X
-#else
-#define HANDLE_FULL(X) &noop
-#endif
-
-void (*const asidstartcmdhandler[])(void) = {
-    &noop,                                // 0
-    &noop,                                // 1
-    &noop,                                // 2
-    &noop,                                // 3
-    &noop,                                // 4
-    &noop,                                // 5
-    &noop,                                // 6
-    &noop,                                // 7
-    &noop,                                // 8
-    &noop,                                // 9
-    &noop,                                // a
-    &noop,                                // b
-    &noop,                                // c
-    &noop,                                // d
-    &noop,                                // e
-    &noop,                                // f
-    &noop,                                // 10
-    &noop,                                // 11
-    &noop,                                // 12
-    &noop,                                // 13
-    &noop,                                // 14
-    &noop,                                // 15
-    &noop,                                // 16
-    &noop,                                // 17
-    &noop,                                // 18
-    &noop,                                // 19
-    &noop,                                // 1a
-    &noop,                                // 1b
-    &noop,                                // 1c
-    &noop,                                // 1d
-    &noop,                                // 1e
-    &noop,                                // 1f
-    &noop,                                // 20
-    &noop,                                // 21
-    &noop,                                // 22
-    &noop,                                // 23
-    &noop,                                // 24
-    &noop,                                // 25
-    &noop,                                // 26
-    &noop,                                // 27
-    &noop,                                // 28
-    &noop,                                // 29
-    &noop,                                // 2a
-    &noop,                                // 2b
-    &noop,                                // 2c
-    &noop,                                // 2d
-    &noop,                                // 2e
-    &noop,                                // 2f
-    &noop,                                // 30
-    &noop,                                // 31
-    &noop,                                // 32
-    &noop,                                // 33
-    &noop,                                // 34
-    &noop,                                // 35
-    &noop,                                // 36
-    &noop,                                // 37
-    &noop,                                // 38
-    &noop,                                // 39
-    &noop,                                // 3a
-    &noop,                                // 3b
-    &noop,                                // 3c
-    &noop,                                // 3d
-    &noop,                                // 3e
-    &noop,                                // 3f
-    &noop,                                // 40
-    &noop,                                // 41
-    &noop,                                // 42
-    &noop,                                // 43
-    &noop,                                // 44
-    &noop,                                // 45
-    &noop,                                // 46
-    &noop,                                // 47
-    &noop,                                // 48
-    &noop,                                // 49
-    &noop,                                // 4a
-    &noop,                                // 4b
-    &handlestart,                         // 4c ASID_CMD_START
-    &handlestop,                          // 4d ASID_CMD_STOP
-    &handleupdate,                        // 4e ASID_CMD_UPDATE
-    &noop,                                // 4f
-    &handleupdate,                        // 50 ASID_CMD_UPDATE2
-    &handleupdate,                        // 51 ASID_CMD_UPDATE_BOTH
-    HANDLE_FULL(&setasidstop),            // 52 ASID_CMD_RUN_BUFFER
-    HANDLE_FULL(&start_handle_load),      // 53 ASID_CMD_LOAD_BUFFER
-    HANDLE_FULL(&start_handle_addr),      // 54 ASID_CMD_ADDR_BUFFER
-    HANDLE_FULL(&start_handle_load_rect), // 55 ASID_CMD_LOAD_RECT_BUFFER
-    HANDLE_FULL(&start_handle_addr_rect), // 56 ASID_CMD_ADDR_RECT_BUFFER
-    HANDLE_FULL(&start_handle_fill),      // 57 ASID_CMD_FILL_BUFFER
-    HANDLE_FULL(&start_handle_fill),      // 58 ASID_CMD_FILL_RECT_BUFFER
-    HANDLE_FULL(&start_handle_copy),      // 59 ASID_CMD_COPY_BUFFER
-    HANDLE_FULL(&start_handle_copy),      // 5a ASID_CMD_COPY_RECT_BUFFER
-    HANDLE_FULL(&start_handle_reu),       // 5b ASID_CMD_REU_STASH_BUFFER
-    HANDLE_FULL(&start_handle_reu),       // 5c ASID_CMD_REU_FETCH_BUFFER
-    HANDLE_FULL(&start_handle_reu_fill),  // 5d ASID_CMD_REU_FILL_BUFFER
-    HANDLE_FULL(&start_handle_reu),       // 5e ASID_CMD_REU_STASH_BUFFER_RECT
-    HANDLE_FULL(&start_handle_reu),       // 5f ASID_CMD_REU_FETCH_BUFFER_RECT
-    HANDLE_FULL(&start_handle_reu_fill),  // 60 ASID_CMD_REU_FILL_BUFFER_RECT
-    &noop,                                // 61
-    &noop,                                // 62
-    &noop,                                // 63
-    &noop,                                // 64
-    &noop,                                // 65
-    &noop,                                // 66
-    &noop,                                // 67
-    &noop,                                // 68
-    &noop,                                // 69
-    &noop,                                // 6a
-    &noop,                                // 6b
-    &start_handle_reg,                    // 6c ASID_CMD_UPDATE_REG
-    &start_handle_reg2,                   // 6d ASID_CMD_UPDATE2_REG
-    &noop,                                // 6e
-    &noop,                                // 6f
-    &noop,                                // 70
-    &noop,                                // 71
-    &noop,                                // 72
-    &noop,                                // 73
-    &noop,                                // 74
-    &noop,                                // 75
-    &noop,                                // 76
-    &noop,                                // 77
-    &noop,                                // 78
-    &noop,                                // 79
-    &noop,                                // 7a
-    &noop,                                // 7b
-    &noop,                                // 7c
-    &noop,                                // 7d
-    &noop,                                // 7e
-    &noop,                                // 7f
-};
+void sendcaps(void);
+
+// Command registry: each command has a start handler, called when its command
+// byte arrives, and a stop handler, called on SYSEX_STOP if the start handler
+// called setasidstop(). The table is indexed from ASID_CMD_FIRST, and IDs
+// with no entry are ignored.
+#define ASID_CMDS(X)                                                           \
+  X(ASID_CMD_START, &handlestart, &initsid)                                    \
+  X(ASID_CMD_STOP, &handlestop, &initsid)                                      \
+  X(ASID_CMD_UPDATE, &handleupdate, &updatesid)                                \
+  X(ASID_CMD_UPDATE2, &handleupdate, &updatesid2)                              \
+  X(ASID_CMD_UPDATE_BOTH, &handleupdate, &updatebothsid)                       \
+  X(ASID_CMD_UPDATE_REG, &start_handle_reg, &noop)                             \
+  X(ASID_CMD_UPDATE2_REG, &start_handle_reg2, &noop)                           \
+  X(ASID_CMD_CAPS, &setasidstop, &sendcaps)
 
-void (*const asidstopcmdhandler[])(void) = {
-    &noop,                        // 0
-    &noop,                        // 1
-    &noop,                        // 2
-    &noop,                        // 3
-    &noop,                        // 4
-    &noop,                        // 5
-    &noop,                        // 6
-    &noop,                        // 7
-    &noop,                        // 8
-    &noop,                        // 9
-    &noop,                        // a
-    &noop,                        // b
-    &noop,                        // c
-    &noop,                        // d
-    &noop,                        // e
-    &noop,                        // f
-    &noop,                        // 10
-    &noop,                        // 11
-    &noop,                        // 12
-    &noop,                        // 13
-    &noop,                        // 14
-    &noop,                        // 15
-    &noop,                        // 16
-    &noop,                        // 17
-    &noop,                        // 18
-    &noop,                        // 19
-    &noop,                        // 1a
-    &noop,                        // 1b
-    &noop,                        // 1c
-    &noop,                        // 1d
-    &noop,                        // 1e
-    &noop,                        // 1f
-    &noop,                        // 20
-    &noop,                        // 21
-    &noop,                        // 22
-    &noop,                        // 23
-    &noop,                        // 24
-    &noop,                        // 25
-    &noop,                        // 26
-    &noop,                        // 27
-    &noop,                        // 28
-    &noop,                        // 29
-    &noop,                        // 2a
-    &noop,                        // 2b
-    &noop,                        // 2c
-    &noop,                        // 2d
-    &noop,                        // 2e
-    &noop,                        // 2f
-    &noop,                        // 30
-    &noop,                        // 31
-    &noop,                        // 32
-    &noop,                        // 33
-    &noop,                        // 34
-    &noop,                        // 35
-    &noop,                        // 36
-    &noop,                        // 37
-    &noop,                        // 38
-    &noop,                        // 39
-    &noop,                        // 3a
-    &noop,                        // 3b
-    &noop,                        // 3c
-    &noop,                        // 3d
-    &noop,                        // 3e
-    &noop,                        // 3f
-    &noop,                        // 40
-    &noop,                        // 41
-    &noop,                        // 42
-    &noop,                        // 43
-    &noop,                        // 44
-    &noop,                        // 45
-    &noop,                        // 46
-    &noop,                        // 47
-    &noop,                        // 48
-    &noop,                        // 49
-    &noop,                        // 4a
-    &noop,                        // 4b
-    &initsid,                     // 4c ASID_CMD_START
-    &initsid,                     // 4d ASID_CMD_STOP
-    &updatesid,                   // 4e ASID_CMD_UPDATE
-    &noop,                        // 4f
-    &updatesid2,                  // 50 ASID_CMD_UPDATE2
-    &updatebothsid,               // 51 ASID_CMD_UPDATE_BOTH
-    HANDLE_FULL(&indirect),       // 52 ASID_CMD_RUN_BUFFER
-    &noop,                        // 53 ASID_CMD_LOAD_BUFFER
-    &noop,                        // 54 ASID_CMD_ADDR_BUFFER
-    &noop,                        // 55 ASID_CMD_LOAD_RECT_BUFFER
-    HANDLE_FULL(&calcrect),       // 56 ASID_CMD_ADDR_RECT_BUFFER
-    HANDLE_FULL(&fillbuffer),     // 57 ASID_CMD_FILL_BUFFER
-    HANDLE_FULL(&fillrectbuffer), // 58 ASID_CMD_FILL_RECT_BUFFER
-    HANDLE_FULL(&copybuffer),     // 59 ASID_CMD_COPY_BUFFER
-    HANDLE_FULL(&copyrectbuffer), // 5a ASID_CMD_COPY_RECT_BUFFER
-    HANDLE_FULL(&reustash),       // 5b ASID_CMD_REU_STASH_BUFFER
-    HANDLE_FULL(&reufetch),       // 5c ASID_CMD_REU_FETCH_BUFFER
-    HANDLE_FULL(&reufetch),       // 5d ASID_CMD_REU_FILL_BUFFER
-    HANDLE_FULL(&reustashrect),   // 5e ASID_CMD_REU_STASH_BUFFER_RECT
-    HANDLE_FULL(&reufetchrect),   // 5f ASID_CMD_REU_FETCH_BUFFER_RECT
-    HANDLE_FULL(&reufetchrect),   // 60 ASID_CMD_REU_FILL_BUFFER_RECT
-    &noop,                        // 61
-    &noop,                        // 62
-    &noop,                        // 63
-    &noop,                        // 64
-    &noop,                        // 65
-    &noop,                        // 66
-    &noop,                        // 67
-    &noop,                        // 68
-    &noop,                        // 69
-    &noop,                        // 6a
-    &noop,                        // 6b
-    &noop,                        // 6c ASID_CMD_UPDATE_REG
-    &noop,                        // 6d ASID_CMD_UPDATE2_REG
-    &noop,                        // 6e
-    &noop,                        // 6f
-    &noop,                        // 70
-    &noop,                        // 71
-    &noop,                        // 72
-    &noop,                        // 73
-    &noop,                        // 74
-    &noop,                        // 75
-    &noop,                        // 76
-    &noop,                        // 77
-    &noop,                        // 78
-    &noop,                        // 79
-    &noop,                        // 7a
-    &noop,                        // 7b
-    &noop,                        // 7c
-    &noop,                        // 7d
-    &noop,                        // 7e
-    &noop,                        // 7f
-};
+#ifndef FULL
+#define ASID_FULL_CMDS(X)
+#endif
+
+#define ASID_CMD_ENTRY(id, start, stop) [(id)-ASID_CMD_FIRST] = {start, stop},
+
+const struct asidcmd asidcmdhandler[] = {
+    ASID_CMDS(ASID_CMD_ENTRY) ASID_FULL_CMDS(ASID_CMD_ENTRY)};
+
+#define ASID_CMD_COUNT (sizeof(asidcmdhandler) / sizeof(asidcmdhandler[0]))
 
 void __attribute__((interrupt)) _handle_nmi() {
+  IO_IN;
   ACK_CIA2_IRQ;
   ++nmi_in;
+  IO_OUT;
 }
 
-void __attribute__((interrupt)) _handle_irq() { ACK_CIA1_IRQ; }
+void __attribute__((interrupt)) _handle_irq() {
+  IO_IN;
+  ACK_CIA1_IRQ;
+  IO_OUT;
+}
+
+#ifdef CART
+// KERNAL enters a cartridge via the CBM80 header before initialising
+// anything, so run its reset sequence before handing over to crt0.
+asm(".pushsection .cart_start,\"ax\",@progbits\n"
+    ".global cart_start\n"
+    "cart_start:\n"
+    "  sei\n"
+    "  cld\n"
+    "  ldx #$ff\n"
+    "  txs\n"
+    "  jsr $fda3\n" // IOINIT
+    "  jsr $fd50\n" // RAMTAS
+    "  jsr $fd15\n" // RESTOR
+    "  jsr $ff5b\n" // CINT
+    "  jmp _start\n"
+    ".popsection\n");
+#endif
 
 void initvessel(void) {
   VOUT;
@@ -605,45 +588,266 @@ void initvessel(void) {
   VOUT;
 }
 
+enum { VIDEO_PAL, VIDEO_NTSC, VIDEO_OLD_NTSC, VIDEO_DREAN };
+
+struct videostd {
+  const char *name;
+  uint16_t cycles; // per frame
+};
+
+const struct videostd videostds[] = {
+    [VIDEO_PAL] = {" PAL", 19656},         // 312 lines of 63 cycles
+    [VIDEO_NTSC] = {" NTSC", 17095},       // 263 lines of 65 cycles
+    [VIDEO_OLD_NTSC] = {" NTSC-O", 16768}, // 262 lines of 64 cycles
+    [VIDEO_DREAN] = {" DREAN", 20280},     // 312 lines of 65 cycles
+};
+
+unsigned char video = VIDEO_PAL;
+
+// Find the last raster line, and time one frame with CIA1 timer B to tell
+// PAL from Drean, which both have 312 lines. Call with interrupts disabled.
+void detectvideo(void) {
+  unsigned char last = 0;
+  CIA1.crb = 0;
+  CIA1.tb_lo = 0xff;
+  CIA1.tb_hi = 0xff;
+  while (!(VIC.ctrl1 & 0x80)) {
+  }
+  while (VIC.ctrl1 & 0x80) {
+  }
+  CIA1.crb = 0b00010001; // load and start timer B
+  while (!(VIC.ctrl1 & 0x80)) {
+  }
+  while (VIC.ctrl1 & 0x80) {
+    if (VIC.rasterline > last) {
+      last = VIC.rasterline;
+    }
+  }
+  CIA1.crb = 0;
+  uint16_t cycles = 0xffff - *((volatile uint16_t *)(&CIA1.tb_lo));
+  if (last > 6) {
+    video = cycles < 19968 ? VIDEO_PAL : VIDEO_DREAN;
+  } else {
+    video = last == 6 ? VIDEO_NTSC : VIDEO_OLD_NTSC;
+  }
+}
+
+// Free running frame timer. It does not interrupt; FULL polls its underflow
+// flag when idle.
 void set_cia_timer(uint16_t v) {
-  SEI();
   CIA1.icr = 0b01111111; // disable all CIA1 interrupts
-  ACK_CIA1_IRQ;
   CIA1.cra &= 0b11111110; // disable timer A
-  CIA1.icr = 0b10000001;  // enable timer A interrupt
   volatile uint16_t *timer = (uint16_t *)(&CIA1.ta_lo);
   *timer = v;
-  CIA1.cra = 0b10000001; // start timer A
-  CLI();
+  CIA1.cra = 0b10010001; // load and start timer A
+  ACK_CIA1_IRQ;
 }
 
-void init() {
-  asm("jsr $e544"); // clear screen
-  initsid();
+#define CAPS_FULL 0x01
+#define CAPS_POLL 0x02
+#define CAPS_CART 0x04
+#define CAPS_BANKED 0x08
+#define CAPS_CMD_BYTES 5
+#define CAPS_AREAS 2
+#define STACK_RESERVE 0x100
+
+extern char __heap_start[];
+extern char __stack[];
+
+struct {
+  unsigned char flags;  // CAPS_*
+  unsigned char video;  // VIDEO_*
+  unsigned char sids;   // number of SIDs found
+  unsigned char models; // bit n set if SID n+1 is a 6581, clear for 8580
+  uint16_t reubanks;    // 64K REU banks, 0 if none
+  struct {
+    uint16_t start;
+    uint16_t end; // exclusive, 0 if the area is absent
+  } free[CAPS_AREAS];
+  // Bit n of byte m set if command ASID_CMD_FIRST + 8m + n is supported.
+  unsigned char cmds[CAPS_CMD_BYTES];
+} caps;
+
+// SounDemon's method: start voice 3 sawtooth at full frequency and read it
+// straight back, which a 6581 has advanced one step further than an 8580.
+// Raster line 255 has no badline to delay the read.
+#define SIDMODEL(b, r)                                                         \
+  while (VIC.rasterline != 0xff) {                                             \
+  }                                                                            \
+  asm volatile("lda #$ff\n"                                                    \
+               "sta %[c]\n"                                                    \
+               "sta %[fl]\n"                                                   \
+               "sta %[fh]\n"                                                   \
+               "lda #$20\n"                                                    \
+               "sta %[c]\n"                                                    \
+               "lda %[o]\n"                                                    \
+               : "=a"(r)                                                       \
+               : [c] "i"((const uint16_t)(b) + 0x12),                          \
+                 [fl] "i"((const uint16_t)(b) + 0x0e),                         \
+                 [fh] "i"((const uint16_t)(b) + 0x0f),                         \
+                 [o] "i"((const uint16_t)(b) + SIDOSC3));
+
+// On a stock C64 $D420 mirrors $D400. Hold SID1 voice 3 at 0 with its test
+// bit, then run voice 3 through $D420: only a mirror moves SID1.
+unsigned char detectsid2(void) {
+  SIDBASE[0x12] = 0x28;
+  SIDBASE2[0x0e] = 0xff;
+  SIDBASE2[0x0f] = 0xff;
+  SIDBASE2[0x12] = 0x28;
+  if (SIDBASE2[SIDOSC3]) {
+    return 0; // nothing decodes $D420
+  }
+  SIDBASE2[0x12] = 0x20;
+  if (SIDBASE[SIDOSC3]) {
+    return 0;
+  }
+  return SIDBASE2[SIDOSC3] != 0;
+}
+
+// Probe the hardware once at startup, with interrupts disabled and before
+// initsid().
+void initcaps(void) {
+  unsigned char r;
+  unsigned char i;
+  caps.flags = 0;
 #ifdef FULL
-  initfull();
+  caps.flags |= CAPS_FULL;
+#endif
+#ifdef POLL
+  caps.flags |= CAPS_POLL;
+#endif
+#ifdef CART
+  caps.flags |= CAPS_CART;
 #endif
+#ifdef BANKED_BUFFERS
+  caps.flags |= CAPS_BANKED;
+#endif
+  caps.video = video;
+  caps.sids = 1;
+  SIDMODEL(SIDBASE, r);
+  caps.models = r & 0x01;
+  if (detectsid2()) {
+    caps.sids = 2;
+    SIDMODEL(SIDBASE2, r);
+    caps.models |= (r & 0x01) << 1;
+  }
+#ifdef FULL
+  caps.reubanks = detectreu();
+#else
+  caps.reubanks = 0;
+#endif
+  caps.free[0].start = (uint16_t)__heap_start;
+#ifdef CART
+  // Skip the cartridge ROM (or BASIC, on an 8K cartridge) at $8000-$BFFF.
+  caps.free[0].end = 0x8000;
+  caps.free[1].start = 0xc000;
+  caps.free[1].end = (uint16_t)__stack - STACK_RESERVE;
+#else
+  caps.free[0].end = (uint16_t)__stack - STACK_RESERVE;
+  // RAM under the KERNAL, and under I/O if buffer commands can bank it out,
+  // up to the hardware vectors.
+#ifdef BANKED_BUFFERS
+  caps.free[1].start = 0xd000;
+#else
+  caps.free[1].start = 0xe000;
+#endif
+  caps.free[1].end = 0xfffa;
+#endif
+  memset(caps.cmds, 0, sizeof(caps.cmds));
+#ifdef FULL
+  for (i = 0; i < ASID_CMD_COUNT && i < CAPS_CMD_BYTES * 8; ++i) {
+    if (asidcmdhandler[i].start) {
+      caps.cmds[i >> 3] |= 1 << (i & 7);
+    }
+  }
+#else
+  // Only the commands midiloop() handles.
+  static const unsigned char cmds[] = {
+      ASID_CMD_START,      ASID_CMD_STOP,        ASID_CMD_UPDATE,
+      ASID_CMD_UPDATE2,    ASID_CMD_UPDATE_REG,  ASID_CMD_UPDATE2_REG,
+      ASID_CMD_CAPS,       ASID_CMD_VISUALISER,  ASID_CMD_SNAPSHOT,
+  };
+  for (i = 0; i < sizeof(cmds); ++i) {
+    r = cmds[i] - ASID_CMD_FIRST;
+    caps.cmds[r >> 3] |= 1 << (r & 7);
+  }
+#endif
+}
+
+// Reply F0 2D 6A <packed caps> <VAP_VERSION> F7.
+void sendcaps(void) {
+  vsysexstart(ASID_CMD_CAPS);
+  vsendpacked((const unsigned char *)&caps, sizeof(caps));
   const char *c = VAP_VERSION;
+  while (*c) {
+    VW(*c++);
+  }
+  VW(SYSEX_STOP);
+}
+
+#ifndef FULL
+// Only the SID shadows, as there is no buffer setup. There is no restore
+// (0x6e): midiloop() takes each SysEx whole into asidupdate, which has no room
+// for one, so hosts send the shadows back with 0x4e and 0x50.
+void sendsnapshot() {
+  vsysexstart(ASID_CMD_SNAPSHOT);
+  vsendpacked(sidshadow, sizeof(sidshadow));
+  vsendpacked(sidshadow2, sizeof(sidshadow2));
+  VW(SYSEX_STOP);
+}
+#endif
+
+void printstr(const char *c) {
   while (*c) {
     putchar(*c++);
   }
+}
+
+void init() {
+  asm("jsr $e544"); // clear screen
   SEI();
-  R6510 = 0b00000101; // disable kernal + basic, makes new handlers visible
+  detectvideo();
+  initcaps();
+  CLI();
+  ch = 0;
+  bufi = 0;
+  datahandler = &noop;
+  initsid();
+#ifdef FULL
+  initfull();
+#endif
+  printstr(VAP_VERSION);
+  printstr(videostds[video].name);
+  SEI();
+  R6510 = R6510_DEFAULT;
+#ifdef CART
+  KERNAL_NMI_VECTOR = (volatile uint16_t) & _handle_nmi;
+#else
   NMI_VECTOR = (volatile uint16_t) & _handle_nmi;
   IRQ_VECTOR = (volatile uint16_t) & _handle_irq;
+#endif
   VIC.imr = 0; // disable VIC II interrupts.
   ACK_VIC_IRQ;
   CIA2.icr = 0b10010000; // set CIA2 interrupt source to FLAG2 only
   ACK_CIA2_IRQ;
-  // set_cia_timer(19656);
+  set_cia_timer(videostds[video].cycles - 1);
   initvessel();
 }
 
 void handle_cmd() {
-  cmd = ch;
+  cmd = ch - ASID_CMD_FIRST;
   datahandler = &noop;
   stophandler = &noop;
-  (*asidstartcmdhandler[cmd])();
+#ifdef FULL
+  // Only SID updates overtake a buffer operation in progress.
+  if ((ch < ASID_CMD_UPDATE || ch > ASID_CMD_UPDATE_BOTH) &&
+      ch != ASID_CMD_UPDATE_REG && ch != ASID_CMD_UPDATE2_REG) {
+    drain_buffertask();
+  }
+#endif
+  if (cmd < ASID_CMD_COUNT && asidcmdhandler[cmd].start) {
+    (*asidcmdhandler[cmd].start)();
+  }
 }
 
 void handle_manid() {
@@ -664,7 +868,8 @@ void midiloop(void) {
 #ifdef FULL
   for (;;) {
 #ifndef POLL
-    if (nmi_in == nmi_ack) {
+    if (!NMI_PENDING(nmi_ack)) {
+      idle();
       continue;
     }
 #endif
@@ -677,8 +882,14 @@ void midiloop(void) {
     nmi_ack = nmi_in;
 #endif
     VOUT;
-    for (i = c; i; --i) {
-      ch = buf[i];
+#ifdef POLL
+    if (!c) {
+      idle();
+    }
+#endif
+    bufi = c;
+    while (bufi) {
+      ch = buf[bufi--];
       if (ch & 0x80) {
         switch (ch) {
         case SYSEX_STOP:
@@ -694,6 +905,7 @@ void midiloop(void) {
           datahandler = &handle_single_reg2;
           break;
         default:
+          handle_channel_status();
           break;
         }
       } else {
@@ -704,7 +916,8 @@ void midiloop(void) {
 #else
   for (;;) {
 #ifndef POLL
-    if (nmi_in == nmi_ack) {
+    if (!NMI_PENDING(nmi_ack)) {
+      vis();
       continue;
     }
     nmi_ack = nmi_in;
@@ -714,6 +927,9 @@ void midiloop(void) {
       c = VR;
       if (c == 0) {
         VOUT;
+#ifdef POLL
+        vis();
+#endif
         break;
       }
       while (c--) {
@@ -725,27 +941,40 @@ void midiloop(void) {
         }
       }
       VOUT;
-      switch (asidupdate.cmd) {
-      case ASID_CMD_UPDATE:
-        updatesid();
-        break;
-      case ASID_CMD_UPDATE_REG:
-        asidupdateregsid(sidshadow);
-        sidfromshadow(sidshadow, SIDBASE);
-        break;
-      case ASID_CMD_UPDATE2:
-        updatesid2();
-        break;
-      case ASID_CMD_UPDATE2_REG:
-        asidupdateregsid(sidshadow2);
-        sidfromshadow(sidshadow2, SIDBASE2);
-        break;
-      case ASID_CMD_START:
-        handlestart();
-        break;
-      case ASID_CMD_STOP:
-        handlestop();
-        break;
+      // Act only once a whole message is in: i is reset at SYSEX_STOP, and
+      // asidupdate.cmd is stale until then.
+      if (!i) {
+        switch (asidupdate.cmd) {
+        case ASID_CMD_UPDATE:
+          updatesid();
+          break;
+        case ASID_CMD_UPDATE_REG:
+          asidupdateregsid(sidshadow);
+          sidfromshadow(sidshadow, SIDBASE);
+          break;
+        case ASID_CMD_UPDATE2:
+          updatesid2();
+          break;
+        case ASID_CMD_UPDATE2_REG:
+          asidupdateregsid(sidshadow2);
+          sidfromshadow(sidshadow2, SIDBASE2);
+          break;
+        case ASID_CMD_START:
+          handlestart();
+          break;
+        case ASID_CMD_STOP:
+          handlestop();
+          break;
+        case ASID_CMD_CAPS:
+          sendcaps();
+          break;
+        case ASID_CMD_VISUALISER:
+          setvis(asidregupdatep->updates[0] != 0);
+          break;
+        case ASID_CMD_SNAPSHOT:
+          sendsnapshot();
+          break;
+        }
       }
       if (c == 0) {
         break;
@@ -33,7 +33,22 @@
     PORTB_DDR = 0x00;                                                         \
   }
 #define VW(x) PORTB = x
+#ifdef SCRIPT
+// Latency harness (see latency.py): reads come from a script at SCRIPT_BASE,
+// a 2 byte length followed by the bytes PORTB reads would return, instead of
+// from Vessel. Reads past the end return 0, as when no input is waiting.
+#include <stdint.h>
+#define SCRIPT_BASE 0x9000
+#define SCRIPT_LEN (*((volatile uint16_t *)SCRIPT_BASE))
+#define SCRIPT_DATA ((volatile unsigned char *)SCRIPT_BASE + 2)
+uint16_t scriptpos = 0;
+inline unsigned char scriptread(void) {
+  return scriptpos < SCRIPT_LEN ? SCRIPT_DATA[scriptpos++] : 0;
+}
+#define VR scriptread()
+#else
 #define VR PORTB
+#endif
 #define VCMD(cmd)                                                              \
   {                                                                            \
     VW(0xfd);                                                                  \